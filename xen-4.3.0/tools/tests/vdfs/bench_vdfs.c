@@ -0,0 +1,191 @@
+/*
+ * bench_vdfs.c: cost of the VDFS work on the context switch path, with
+ * and without VDFS accounting, across VCPU counts and switch rates. That
+ * work is schedule()'s: vcpu_runstate_change() for prev and next, with
+ * their seqcount barriers, lazy folding and wait histogram, and
+ * vcpu_vdfs_commit() for next, all run through the same xen/vdfs.h code
+ * as the hypervisor (see vdfs_sim.h).
+ *
+ * Usage: bench_vdfs [-n switches] [-l limit]
+ *
+ * Each cell switches round robin between the VCPUs of one physical CPU
+ * at the given rate, in simulated time, so that lazy folding happens as
+ * often as it would on a host. Cycles are TSC cycles where there is a
+ * TSC, ns otherwise.
+ *
+ * Fails if a cell with accounting costs more than @limit cycles per
+ * switch (if given), if the averages were folded more often than once
+ * per fold interval per VCPU, or if a switch went unrecorded in the wait
+ * histograms.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+#include "vdfs_sim.h"
+
+static uint64_t cycles(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static const unsigned int nr_vcpus[] = { 1, 2, 4, 16, 64, 256 };
+static const unsigned int rates[] = { 1000, 10000, 100000, 1000000 };
+#define NR_VCPU_COUNTS (sizeof(nr_vcpus) / sizeof(nr_vcpus[0]))
+#define NR_RATES       (sizeof(rates) / sizeof(rates[0]))
+#define MAX_VCPUS      256
+
+#define HALFLIFE       SIM_MILLISECS(32)
+
+static unsigned long opt_switches = 1000000;
+
+/* Switches in to @n VCPUs on record in their wait histograms. */
+static unsigned long waits(const struct sim_vcpu *vcpu, unsigned int n)
+{
+    uint64_t hist[VDFS_HIST_BUCKETS] = { 0 };
+    unsigned long total = 0;
+    unsigned int i;
+
+    for ( i = 0; i < n; i++ )
+        vdfs_wait_hist_add(&vcpu[i].vdfs, hist);
+    for ( i = 0; i < VDFS_HIST_BUCKETS; i++ )
+        total += hist[i];
+
+    return total;
+}
+
+/*
+ * Cycles per switch for @n VCPUs switching @rate times a second. Clears
+ * @ok if the averages were folded more often than they should be, or if
+ * the wait histograms missed a switch.
+ */
+static double bench(struct sim_vcpu *vcpu, unsigned int n, unsigned int rate,
+                    int accounting, int *ok)
+{
+    struct sim s;
+    s_time_t now = 0, step = 1000000000LL / rate;
+    unsigned long i, max_folds, switches = 0;
+    unsigned int prev = 0, next;
+    uint64_t start, total;
+
+    sim_init(&s, HALFLIFE, 2000000);
+    s.accounting = accounting;
+    for ( next = 0; next < n; next++ )
+        sim_vcpu_init(&vcpu[next], next ? SIM_RUNNABLE : SIM_RUNNING, 0);
+
+    start = cycles();
+    for ( i = 0; i < opt_switches; i++ )
+    {
+        now += step;
+        next = (prev + 1 == n) ? 0 : prev + 1;
+        if ( next == prev )
+        {
+            /* Only one VCPU: schedule() keeps it running and ticks it. */
+            sim_tick(&s, &vcpu[prev], now);
+            continue;
+        }
+        sim_switch(&s, &vcpu[prev], SIM_RUNNABLE, &vcpu[next], now);
+        prev = next;
+        switches++;
+    }
+    total = cycles() - start;
+
+    /* Each VCPU folds at most once per interval, plus once at the end. */
+    max_folds = accounting ? n * (now / s.fold_interval + 1) : 0;
+    if ( s.folds > max_folds )
+    {
+        printf("\n  %u VCPUs at %u/s: %lu folds, at most %lu expected",
+               n, rate, s.folds, max_folds);
+        *ok = 0;
+    }
+    if ( waits(vcpu, n) != switches )
+    {
+        printf("\n  %u VCPUs at %u/s: %lu waits recorded for %lu switches",
+               n, rate, waits(vcpu, n), switches);
+        *ok = 0;
+    }
+
+    return (double)total / opt_switches;
+}
+
+int main(int argc, char **argv)
+{
+    static struct sim_vcpu vcpu[MAX_VCPUS];
+    unsigned int v, r;
+    double limit = 0, c, worst = 0;
+    int accounting, ok = 1, ch;
+
+    while ( (ch = getopt(argc, argv, "n:l:")) != -1 )
+    {
+        switch ( ch )
+        {
+        case 'n':
+            opt_switches = strtoul(optarg, NULL, 0) ? : opt_switches;
+            break;
+        case 'l':
+            limit = strtod(optarg, NULL);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n switches] [-l limit]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    printf("Cycles per context switch, %lu switches per cell\n",
+           opt_switches);
+    for ( accounting = 0; accounting <= 1; accounting++ )
+    {
+        printf("\n%-14s", accounting ? "accounting" : "no accounting");
+        for ( v = 0; v < NR_VCPU_COUNTS; v++ )
+            printf("%6u VCPUs", nr_vcpus[v]);
+        printf("\n");
+
+        for ( r = 0; r < NR_RATES; r++ )
+        {
+            printf("%9u/s    ", rates[r]);
+            for ( v = 0; v < NR_VCPU_COUNTS; v++ )
+            {
+                c = bench(vcpu, nr_vcpus[v], rates[r], accounting, &ok);
+                printf("%12.1f", c);
+                if ( accounting && (c > worst) )
+                    worst = c;
+            }
+            printf("\n");
+        }
+    }
+
+    if ( !ok )
+    {
+        printf("Averages folded too often, or waits missed\n");
+        return 1;
+    }
+    if ( limit && (worst > limit) )
+    {
+        printf("Worst case %.1f cycles per switch, over the limit of %.1f\n",
+               worst, limit);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
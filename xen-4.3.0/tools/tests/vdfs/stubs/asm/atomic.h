@@ -0,0 +1,35 @@
+/*
+ * Stand-in for asm/atomic.h: the atomics the VDFS headers use, as the
+ * compiler's builtins, with the hypervisor's signatures.
+ */
+
+#ifndef __ASM_ATOMIC_H__
+#define __ASM_ATOMIC_H__
+
+typedef struct { int counter; } atomic_t;
+
+#define ATOMIC_INIT(i)   { (i) }
+
+#define read_atomic(p)   __atomic_load_n(p, __ATOMIC_RELAXED)
+
+static inline int atomic_read(const atomic_t *v)
+{
+    return read_atomic(&v->counter);
+}
+
+static inline void atomic_set(atomic_t *v, int i)
+{
+    __atomic_store_n(&v->counter, i, __ATOMIC_RELAXED);
+}
+
+static inline void atomic_add(int i, atomic_t *v)
+{
+    __atomic_fetch_add(&v->counter, i, __ATOMIC_SEQ_CST);
+}
+
+static inline void atomic_sub(int i, atomic_t *v)
+{
+    __atomic_fetch_sub(&v->counter, i, __ATOMIC_SEQ_CST);
+}
+
+#endif /* __ASM_ATOMIC_H__ */
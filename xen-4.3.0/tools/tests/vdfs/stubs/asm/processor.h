@@ -0,0 +1,14 @@
+/* Stand-in for asm/processor.h: cpu_relax(). */
+
+#ifndef __ASM_PROCESSOR_H__
+#define __ASM_PROCESSOR_H__
+
+#include <asm/system.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax()  __asm__ __volatile__ ( "rep; nop" : : : "memory" )
+#else
+#define cpu_relax()  barrier()
+#endif
+
+#endif /* __ASM_PROCESSOR_H__ */
@@ -0,0 +1,19 @@
+/*
+ * Stand-in for asm/system.h: the SMP barriers, which on x86 only need to
+ * stop the compiler from reordering, as in the hypervisor.
+ */
+
+#ifndef __ASM_SYSTEM_H__
+#define __ASM_SYSTEM_H__
+
+#define barrier()  __asm__ __volatile__ ( "" : : : "memory" )
+
+#if defined(__i386__) || defined(__x86_64__)
+#define smp_rmb()  barrier()
+#define smp_wmb()  barrier()
+#else
+#define smp_rmb()  __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_wmb()  __atomic_thread_fence(__ATOMIC_RELEASE)
+#endif
+
+#endif /* __ASM_SYSTEM_H__ */
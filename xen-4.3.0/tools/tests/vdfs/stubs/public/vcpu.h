@@ -0,0 +1,26 @@
+/*
+ * Stand-in for public/vcpu.h, which needs the rest of the public headers:
+ * the runstate layout the VDFS headers work on.
+ */
+
+#ifndef __XEN_PUBLIC_VCPU_H__
+#define __XEN_PUBLIC_VCPU_H__
+
+#include <stdint.h>
+
+struct vcpu_runstate_info {
+    int      state;
+    uint64_t state_entry_time;
+    uint64_t time[4];
+};
+
+struct vcpu_avg_runstate_info {
+    uint64_t time[4];
+};
+
+#define RUNSTATE_running  0
+#define RUNSTATE_runnable 1
+#define RUNSTATE_blocked  2
+#define RUNSTATE_offline  3
+
+#endif /* __XEN_PUBLIC_VCPU_H__ */
@@ -0,0 +1,9 @@
+/* Stand-in for xen/cache.h, with x86's line size. */
+
+#ifndef __XEN_CACHE_H__
+#define __XEN_CACHE_H__
+
+#define L1_CACHE_BYTES       128
+#define __cacheline_aligned  __attribute__((__aligned__(L1_CACHE_BYTES)))
+
+#endif /* __XEN_CACHE_H__ */
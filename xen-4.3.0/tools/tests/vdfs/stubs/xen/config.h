@@ -0,0 +1,12 @@
+/*
+ * Stand-in for xen/config.h, which the hypervisor's build includes in
+ * every file: the compiler hints the VDFS headers use.
+ */
+
+#ifndef __XEN_CONFIG_H__
+#define __XEN_CONFIG_H__
+
+#define likely(x)    __builtin_expect(!!(x), 1)
+#define unlikely(x)  __builtin_expect(!!(x), 0)
+
+#endif /* __XEN_CONFIG_H__ */
@@ -0,0 +1,8 @@
+/* Stand-in for xen/string.h. */
+
+#ifndef __XEN_STRING_H__
+#define __XEN_STRING_H__
+
+#include <string.h>
+
+#endif /* __XEN_STRING_H__ */
@@ -0,0 +1,14 @@
+/*
+ * Stand-in for xen/types.h, enough to build the VDFS headers
+ * (xen/vdfs_fixed.h, xen/vdfs.h) in a userspace program.
+ */
+
+#ifndef __XEN_TYPES_H__
+#define __XEN_TYPES_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef int64_t s_time_t;
+
+#endif /* __XEN_TYPES_H__ */
@@ -0,0 +1,275 @@
+/*
+ * test_vdfs_fixed.c: check the VDFS fixed-point helpers (xen/vdfs_fixed.h)
+ * against 128-bit integer and double references, and time them.
+ *
+ * Usage: test_vdfs_fixed [cases per helper [seed]]
+ *
+ * Operands are drawn with uniformly random bit lengths, so that every
+ * magnitude from 0 to 2^64 - 1 is covered as densely as the small ones,
+ * and the boundary values are always checked as well.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <xen/vdfs_fixed.h>
+
+typedef unsigned __int128 u128;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+/* xorshift64* */
+static uint64_t rnd(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+/* A random value of a random bit length up to @bits. */
+static uint64_t rnd_bits(unsigned int bits)
+{
+    unsigned int len = rnd() % (bits + 1);
+
+    return len ? rnd() >> (64 - len) : 0;
+}
+
+static const uint64_t edges[] = {
+    0, 1, 2, 0x7fffffff, 0x80000000, 0xffffffff, 0x100000000ULL,
+    0x100000001ULL, VDFS_RATIO_ONE - 1, VDFS_RATIO_ONE, VDFS_RATIO_ONE + 1,
+    0x7fffffffffffffffULL, 0x8000000000000000ULL, ~0ULL - 1, ~0ULL,
+};
+#define NR_EDGES (sizeof(edges) / sizeof(edges[0]))
+
+/* Operand @i of a run: the edge values first, then random ones. */
+static uint64_t operand(unsigned long i, unsigned int which, unsigned int bits)
+{
+    uint64_t mask = (bits == 64) ? ~0ULL : (1ULL << bits) - 1;
+
+    if ( i < NR_EDGES * NR_EDGES )
+        return (which ? edges[i % NR_EDGES] : edges[i / NR_EDGES]) & mask;
+
+    return rnd_bits(bits);
+}
+
+static uint64_t ref_saturate(u128 x)
+{
+    return (x >> 64) ? ~0ULL : (uint64_t)x;
+}
+
+static unsigned long failures;
+
+static void mismatch(const char *what, uint64_t a, uint64_t b, int64_t c,
+                     uint64_t got, uint64_t want)
+{
+    if ( failures++ < 10 )
+        printf("\n  %s(%#"PRIx64", %#"PRIx64", %"PRId64") = %"PRIu64
+               ", expected %"PRIu64, what, a, b, c, got, want);
+}
+
+static void check_muldiv64(unsigned long n)
+{
+    unsigned long i;
+    uint64_t a, got, want;
+    uint32_t mul, div;
+
+    for ( i = 0; i < n; i++ )
+    {
+        a = operand(i, 0, 64);
+        mul = operand(i, 1, 32);
+        div = rnd_bits(32) ? : 1;
+        got = vdfs_muldiv64(a, mul, div);
+        want = ref_saturate((u128)a * mul / div);
+        if ( got != want )
+            mismatch("vdfs_muldiv64", a, mul, div, got, want);
+    }
+}
+
+static void check_mul_q32(unsigned long n)
+{
+    unsigned long i;
+    uint64_t a, frac, got, want;
+
+    for ( i = 0; i < n; i++ )
+    {
+        a = operand(i, 0, 64);
+        frac = operand(i, 1, 33);
+        if ( frac > (1ULL << 32) )
+            frac = 1ULL << 32;
+        got = vdfs_mul_q32(a, frac);
+        want = ((u128)a * frac) >> 32;
+        if ( got != want )
+            mismatch("vdfs_mul_q32", a, frac, 0, got, want);
+    }
+}
+
+/*
+ * vdfs_ratio() drops the bits of its operands below the top 32 of @total,
+ * which may cost it one part in VDFS_RATIO_ONE against the exact quotient.
+ */
+static void check_ratio(unsigned long n)
+{
+    unsigned long i;
+    uint64_t part, total, got, want, err, max_err = 0;
+
+    for ( i = 0; i < n; i++ )
+    {
+        part = operand(i, 0, 64);
+        total = operand(i, 1, 64);
+        /* Mostly part <= total, as for a share of a runstate total. */
+        if ( (part > total) && (rnd() & 3) )
+            part = total ? rnd() % total : 0;
+        got = vdfs_ratio(part, total);
+        if ( total == 0 )
+            want = 0;
+        else if ( part >= total )
+            want = VDFS_RATIO_ONE;
+        else
+            want = (u128)part * VDFS_RATIO_ONE / total;
+        err = (got > want) ? got - want : want - got;
+        if ( err > max_err )
+            max_err = err;
+        if ( err > 1 )
+            mismatch("vdfs_ratio", part, total, 0, got, want);
+    }
+
+    printf("(max error %"PRIu64"/%u) ", max_err, VDFS_RATIO_ONE);
+}
+
+/* Exact against 128-bit integers, and within rounding of a double. */
+static void check_tsc_khz(unsigned long n)
+{
+    const uint64_t num = 1000000ULL << 32;
+    unsigned long i;
+    uint64_t got, want;
+    uint32_t mul;
+    int shift;
+    double dbl;
+
+    for ( i = 0; i < n; i++ )
+    {
+        mul = operand(i, 0, 32);
+        shift = (int)(rnd() % 100) - 33;
+        got = vdfs_tsc_khz(mul, shift);
+
+        if ( !mul || (shift >= 64) || (shift <= -32) )
+            want = 0;
+        else if ( shift < 0 )
+            want = ref_saturate(((u128)num << -shift) / mul);
+        else
+            want = ref_saturate((u128)num / ((u128)mul << shift));
+        if ( got != want )
+            mismatch("vdfs_tsc_khz", mul, 0, shift, got, want);
+
+        if ( !want || (want == ~0ULL) )
+            continue;
+        dbl = 1e6 * 4294967296.0 / mul;
+        dbl = (shift < 0) ? dbl * (double)(1ULL << -shift)
+                          : dbl / (double)((u128)1 << shift);
+        if ( (got > dbl + 1 + dbl * 1e-15) || (got + 1 + dbl * 1e-15 < dbl) )
+            mismatch("vdfs_tsc_khz (double)", mul, 0, shift, got,
+                     (uint64_t)dbl);
+    }
+}
+
+static void run_check(const char *name, void (*check)(unsigned long),
+                      unsigned long n)
+{
+    unsigned long before = failures;
+
+    printf("%-36s", name);
+    fflush(stdout);
+    check(n);
+    printf("%s\n", (failures == before) ? "okay" : "\nfailed");
+}
+
+/* Timing, over a table of operands generated up front. */
+#define NR_OPS   (1 << 16)
+#define ROUNDS   64
+
+static uint64_t op_a[NR_OPS], op_b[NR_OPS];
+static uint32_t op_c[NR_OPS];
+static volatile uint64_t sink;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#define TIME(name, expr) do {                                             \
+    uint64_t acc = 0;                                                     \
+    unsigned int r, i;                                                    \
+    double start = now_ns();                                              \
+    for ( r = 0; r < ROUNDS; r++ )                                        \
+        for ( i = 0; i < NR_OPS; i++ )                                    \
+            acc += (expr);                                                \
+    sink = acc;                                                           \
+    printf("  %-32s %6.2f ns/call\n", name,                               \
+           (now_ns() - start) / ((double)ROUNDS * NR_OPS));               \
+} while ( 0 )
+
+static void run_timing(void)
+{
+    unsigned int i;
+
+    for ( i = 0; i < NR_OPS; i++ )
+    {
+        op_a[i] = rnd_bits(64);
+        op_b[i] = rnd_bits(32);
+        op_c[i] = rnd_bits(32) ? : 1;
+    }
+
+    printf("Timing (%u calls each):\n", ROUNDS * NR_OPS);
+    TIME("vdfs_muldiv64", vdfs_muldiv64(op_a[i], op_b[i], op_c[i]));
+    TIME("  reference (128-bit divide)",
+         ref_saturate((u128)op_a[i] * op_b[i] / op_c[i]));
+    TIME("vdfs_mul_q32", vdfs_mul_q32(op_a[i], op_b[i]));
+    TIME("vdfs_ratio", vdfs_ratio(op_b[i], op_a[i]));
+    TIME("  reference (128-bit divide)",
+         op_a[i] ? (uint64_t)((u128)op_b[i] * VDFS_RATIO_ONE / op_a[i]) : 0);
+    TIME("vdfs_tsc_khz", vdfs_tsc_khz(op_c[i], (int)(op_b[i] & 7) - 4));
+    TIME("  reference (double)",
+         (uint64_t)(1e6 * 4294967296.0 / op_c[i] /
+                    (double)(1 << (op_b[i] & 7)) * 16));
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long n = 2000000;
+
+    if ( argc > 1 )
+        n = strtoul(argv[1], NULL, 0);
+    if ( argc > 2 )
+        rng_state = strtoull(argv[2], NULL, 0) ? : rng_state;
+
+    printf("%lu cases per helper, seed %#"PRIx64"\n", n, rng_state);
+    run_check("Testing vdfs_muldiv64...", check_muldiv64, n);
+    run_check("Testing vdfs_mul_q32...", check_mul_q32, n);
+    run_check("Testing vdfs_ratio...", check_ratio, n);
+    run_check("Testing vdfs_tsc_khz...", check_tsc_khz, n);
+
+    if ( failures )
+    {
+        printf("%lu mismatches\n", failures);
+        return 1;
+    }
+
+    run_timing();
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,471 @@
+/*
+ * test_vdfs_replay.c: replay runstate traces through the VDFS accounting
+ * and cap control (vdfs_sim.h), and report the effective frequency, the
+ * cap's behaviour and what each call costs.
+ *
+ * Usage: test_vdfs_replay [-h halflife_ms] [-m max_khz] [-r report_ms]
+ *                         [-b credit_ms:burst_pct] [trace]
+ *
+ * Without a trace, runs the built-in synthetic scenarios and checks their
+ * outcome, failing if any is off. A trace ("-" for stdin) has one event
+ * per line, times in ns, '#' starting a comment:
+ *
+ *   <time> <vcpu> running|runnable|blocked|offline
+ *   <time> <vcpu> target <pct>          (0 or 100: no target)
+ *
+ * The states are what the VCPU would do uncapped. While its cap holds it
+ * back it is offline instead, as in Xen; the work it would have done then
+ * is dropped rather than deferred.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "vdfs_sim.h"
+
+#define MAX_VCPUS        64
+#define EV_TARGET        (-1)
+
+struct event {
+    s_time_t     time;
+    unsigned int vcpu;
+    int          what;      /* SIM_* state, or EV_TARGET */
+    unsigned int pct;
+};
+
+struct vcpu_stats {
+    unsigned long periods, capped, bursting;
+    uint64_t      khz_sum;  /* of the samples in the second half */
+    unsigned long samples;
+};
+
+struct replay {
+    struct sim       sim;
+    struct sim_vcpu  vcpu[MAX_VCPUS];
+    int              demand[MAX_VCPUS];
+    s_time_t         cap_due[MAX_VCPUS];   /* 0: no target */
+    struct vcpu_stats stats[MAX_VCPUS];
+    unsigned int     nr_vcpus;
+};
+
+static s_time_t opt_halflife = SIM_MILLISECS(32);
+static uint32_t opt_max_khz = 2000000;
+static s_time_t opt_report = SIM_MILLISECS(100);
+static int64_t  opt_credit;
+static uint32_t opt_burst;
+
+static const char *const state_names[] = {
+    "running", "runnable", "blocked", "offline"
+};
+
+/* Put @v into the state it would be in given its demand and cap. */
+static void set_state(struct replay *r, unsigned int i, s_time_t now)
+{
+    struct sim_vcpu *v = &r->vcpu[i];
+    int state = r->demand[i];
+
+    if ( v->capped && (state <= SIM_RUNNABLE) )
+        state = SIM_OFFLINE;
+    if ( state != v->runstate.state )
+        sim_runstate_change(&r->sim, v, state, now);
+}
+
+static void apply_event(struct replay *r, const struct event *ev)
+{
+    struct sim_vcpu *v = &r->vcpu[ev->vcpu];
+    uint32_t target;
+
+    if ( ev->what != EV_TARGET )
+    {
+        r->demand[ev->vcpu] = ev->what;
+        set_state(r, ev->vcpu, ev->time);
+        return;
+    }
+
+    target = (ev->pct % 100) * (VDFS_RATIO_ONE / 100);
+    if ( target == v->cap.target )
+        return;
+    if ( v->cap.target == 0 )
+        r->cap_due[ev->vcpu] = ev->time + SIM_CAP_PERIOD;
+    sim_apply_target(&r->sim, v, target, ev->time);
+    if ( target == 0 )
+    {
+        r->cap_due[ev->vcpu] = 0;
+        v->capped = 0;
+        set_state(r, ev->vcpu, ev->time);
+    }
+}
+
+static void cap_period(struct replay *r, unsigned int i, s_time_t now)
+{
+    struct sim_vcpu *v = &r->vcpu[i];
+    struct vcpu_stats *st = &r->stats[i];
+
+    v->capped = sim_cap_period(&r->sim, v, now);
+    set_state(r, i, now);
+    r->cap_due[i] = now + SIM_CAP_PERIOD;
+
+    st->periods++;
+    st->capped += v->capped;
+    st->bursting += v->cap.bursting;
+}
+
+static void report(struct replay *r, s_time_t now, s_time_t end, int verbose)
+{
+    uint32_t share[VDFS_NR_STATES], khz, avail;
+    uint64_t throttled;
+    unsigned int i;
+
+    for ( i = 0; i < r->nr_vcpus; i++ )
+    {
+        struct sim_vcpu *v = &r->vcpu[i];
+
+        khz = sim_effective_khz(&r->sim, v, now, share);
+        if ( 2 * now >= end )
+        {
+            r->stats[i].khz_sum += khz;
+            r->stats[i].samples++;
+        }
+        if ( !verbose )
+            continue;
+
+        avail = sim_available_khz(&r->sim, v, now);
+        sim_throttled(&r->sim, v, now, &throttled);
+        printf("%10.3f v%-2u %-8s eff %8"PRIu32" avail %8"PRIu32" kHz"
+               "  target %5.1f%% cap %5.1f%%  throttled %8.3f ms\n",
+               now / 1e6, i, state_names[v->runstate.state], khz, avail,
+               v->cap.target * 100.0 / VDFS_RATIO_ONE,
+               v->cap.target ? v->cap.cap * 100.0 / VDFS_RATIO_ONE : 100.0,
+               throttled / 1e6);
+    }
+}
+
+/*
+ * Replay @nr events, in time order, until @end: the events themselves,
+ * the cap periods of VCPUs with a target, and every @interval a sample of
+ * each VCPU's effective frequency (none if @interval is 0).
+ */
+static void replay(struct replay *r, const struct event *ev, unsigned int nr,
+                   unsigned int nr_vcpus, s_time_t end, s_time_t interval,
+                   int verbose)
+{
+    s_time_t now, next_report = interval ? interval : end + 1;
+    unsigned int i, n = 0, due;
+
+    memset(r, 0, sizeof(*r));
+    sim_init(&r->sim, opt_halflife, opt_max_khz);
+    r->sim.credit.max = opt_credit;
+    r->sim.credit.burst = opt_burst;
+    r->nr_vcpus = nr_vcpus;
+    for ( i = 0; i < nr_vcpus; i++ )
+    {
+        sim_vcpu_init(&r->vcpu[i], SIM_BLOCKED, 0);
+        r->demand[i] = SIM_BLOCKED;
+    }
+
+    for ( ; ; )
+    {
+        /* The earliest of the next event, cap period and sample. */
+        now = (n < nr) ? ev[n].time : end;
+        due = nr_vcpus;
+        for ( i = 0; i < nr_vcpus; i++ )
+            if ( r->cap_due[i] && (r->cap_due[i] < now) )
+            {
+                now = r->cap_due[i];
+                due = i;
+            }
+        if ( next_report <= now )
+        {
+            report(r, next_report, end, verbose);
+            next_report += interval;
+            continue;
+        }
+        if ( due < nr_vcpus )
+            cap_period(r, due, now);
+        else if ( n < nr )
+            apply_event(r, &ev[n++]);
+        else
+            break;
+    }
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static volatile uint64_t sink;
+
+/* What the accounting and the VDFS queries cost per call, on this host. */
+static void report_cost(struct replay *r, const struct event *ev,
+                        unsigned int nr, unsigned int nr_vcpus, s_time_t end)
+{
+    const unsigned int calls = 1000000;
+    struct sim_vcpu *v = &r->vcpu[0];
+    uint32_t share[VDFS_NR_STATES];
+    unsigned int reps, i;
+    uint64_t acc = 0;
+    double start;
+
+    /* Enough replays for about 10^6 events. */
+    reps = nr ? (calls + nr - 1) / nr : 1;
+    start = now_ns();
+    for ( i = 0; i < reps; i++ )
+        replay(r, ev, nr, nr_vcpus, end, 0, 0);
+    printf("Replay: %.1f ns/event, %lu runstate changes, %lu folds,"
+           " %lu cap periods\n", (now_ns() - start) / ((double)reps * nr),
+           r->sim.changes, r->sim.folds, r->sim.periods);
+
+    start = now_ns();
+    for ( i = 0; i < calls; i++ )
+        acc += sim_effective_khz(&r->sim, v, end + i * 1000, share);
+    printf("  VCPUOP_get_dynamic_freq:   %6.1f ns/call\n",
+           (now_ns() - start) / calls);
+
+    start = now_ns();
+    for ( i = 0; i < calls; i++ )
+        acc += sim_available_khz(&r->sim, v, end + i * 1000);
+    printf("  available frequency:       %6.1f ns/call\n",
+           (now_ns() - start) / calls);
+
+    if ( v->cap.target == 0 )
+        sim_apply_target(&r->sim, v, VDFS_RATIO_ONE / 2, end);
+    start = now_ns();
+    for ( i = 0; i < calls; i++ )
+        acc += sim_cap_period(&r->sim, v, end + (i + 1) * SIM_CAP_PERIOD);
+    printf("  cap period:                %6.1f ns/call\n",
+           (now_ns() - start) / calls);
+
+    sink = acc;
+}
+
+static void print_summary(const struct replay *r)
+{
+    const struct vcpu_stats *st;
+    unsigned int i;
+
+    for ( i = 0; i < r->nr_vcpus; i++ )
+    {
+        st = &r->stats[i];
+        printf("v%-2u mean effective %8"PRIu64" kHz (second half),"
+               " %lu cap periods, %lu capped, %lu bursting\n", i,
+               st->samples ? st->khz_sum / st->samples : 0,
+               st->periods, st->capped, st->bursting);
+    }
+}
+
+/* Built-in scenarios: a single VCPU running @busy ns out of each @busy +
+ * @idle, with a target of @target percent. */
+struct scenario {
+    const char *name;
+    s_time_t    busy, idle;
+    unsigned int target;
+    int64_t     credit;
+    uint32_t    burst;
+    unsigned int expect_pct, tolerance_pct;
+    int         capped, bursting;   /* must (1), must not (0), either (-1) */
+};
+
+#define MS(x) SIM_MILLISECS(x)
+
+static const struct scenario scenarios[] = {
+    { "50% duty, no target", MS(5), MS(5), 0, 0, 0, 50, 2, 0, 0 },
+    { "CPU bound, no target", MS(1000), 0, 0, 0, 0, 100, 1, 0, 0 },
+    { "CPU bound, 40% target", MS(1000), 0, 40, 0, 0, 40, 3, 1, 0 },
+    { "CPU bound, 75% target", MS(1000), 0, 75, 0, 0, 75, 3, 1, 0 },
+    { "30% duty, 60% target", MS(3), MS(7), 60, 0, 0, 30, 2, 0, 0 },
+    { "20% bursts, 40% target", MS(100), MS(400), 40, 0, 0, 12, 3, 1, 0 },
+    { "20% bursts, 40% target, credit", MS(100), MS(400), 40,
+      MS(200), VDFS_RATIO_ONE, 20, 3, -1, 1 },
+};
+
+#define COST_SCENARIO    4
+#define SCENARIO_LENGTH  MS(4000)
+#define SCENARIO_EVENTS  4096
+
+static unsigned int build_scenario(const struct scenario *sc,
+                                   struct event *ev)
+{
+    unsigned int nr = 0;
+    s_time_t t;
+
+    ev[nr++] = (struct event){ 0, 0, EV_TARGET, sc->target };
+    for ( t = 0; t < SCENARIO_LENGTH; t += sc->busy + sc->idle )
+    {
+        ev[nr++] = (struct event){ t, 0, SIM_RUNNING, 0 };
+        if ( sc->idle == 0 )
+            break;
+        ev[nr++] = (struct event){ t + sc->busy, 0, SIM_BLOCKED, 0 };
+    }
+
+    return nr;
+}
+
+static int run_scenario(const struct scenario *sc, struct replay *r)
+{
+    static struct event ev[SCENARIO_EVENTS];
+    const struct vcpu_stats *st = &r->stats[0];
+    unsigned int pct;
+    int ok;
+
+    opt_credit = sc->credit;
+    opt_burst = sc->burst;
+    replay(r, ev, build_scenario(sc, ev), 1, SCENARIO_LENGTH, MS(1), 0);
+
+    pct = (st->khz_sum / st->samples) * 100 / opt_max_khz;
+    ok = (pct + sc->tolerance_pct >= sc->expect_pct) &&
+         (pct <= sc->expect_pct + sc->tolerance_pct) &&
+         ((sc->capped < 0) || (!st->capped == !sc->capped)) &&
+         ((sc->bursting < 0) || (!st->bursting == !sc->bursting));
+
+    printf("%-36s%3u%% (expect %u%%), %lu/%lu capped, %lu bursting: %s\n",
+           sc->name, pct, sc->expect_pct, st->capped, st->periods,
+           st->bursting, ok ? "okay" : "failed");
+
+    return ok;
+}
+
+static int parse_trace(FILE *f, struct event **pev, unsigned int *pnr,
+                       unsigned int *pnr_vcpus)
+{
+    struct event *ev = NULL, e;
+    unsigned int nr = 0, max = 0, line = 0, nr_vcpus = 0;
+    char buf[256], what[32];
+    long long time;
+    int i, n;
+
+    while ( fgets(buf, sizeof(buf), f) )
+    {
+        line++;
+        if ( (buf[strspn(buf, " \t")] == '#') ||
+             (buf[strspn(buf, " \t\r\n")] == '\0') )
+            continue;
+
+        n = sscanf(buf, "%lld %u %31s %u", &time, &e.vcpu, what, &e.pct);
+        e.time = time;
+        e.what = EV_TARGET;
+        if ( (n == 4) && !strcmp(what, "target") && (e.pct <= 100) )
+            n = 0;
+        for ( i = 0; (n == 3) && (i < VDFS_NR_STATES); i++ )
+            if ( !strcmp(what, state_names[i]) )
+            {
+                e.what = i;
+                n = 0;
+            }
+        if ( (n != 0) || (e.vcpu >= MAX_VCPUS) || (e.time < 0) ||
+             (nr && (e.time < ev[nr - 1].time)) )
+        {
+            fprintf(stderr, "line %u: bad or out of order event\n", line);
+            free(ev);
+            return -1;
+        }
+
+        if ( nr == max )
+        {
+            max = max ? 2 * max : 1024;
+            if ( (ev = realloc(ev, max * sizeof(*ev))) == NULL )
+                return -1;
+        }
+        ev[nr++] = e;
+        if ( e.vcpu >= nr_vcpus )
+            nr_vcpus = e.vcpu + 1;
+    }
+
+    *pev = ev;
+    *pnr = nr;
+    *pnr_vcpus = nr_vcpus;
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static struct replay r;
+    struct event *ev;
+    unsigned int i, nr, nr_vcpus, failed = 0;
+    unsigned long credit_ms, burst_pct;
+    FILE *f;
+    int c;
+
+    while ( (c = getopt(argc, argv, "h:m:r:b:")) != -1 )
+    {
+        switch ( c )
+        {
+        case 'h':
+            opt_halflife = SIM_MILLISECS(strtoul(optarg, NULL, 0) ? : 32);
+            break;
+        case 'm':
+            opt_max_khz = strtoul(optarg, NULL, 0) ? : opt_max_khz;
+            break;
+        case 'r':
+            opt_report = SIM_MILLISECS(strtoul(optarg, NULL, 0));
+            break;
+        case 'b':
+            if ( (sscanf(optarg, "%lu:%lu", &credit_ms, &burst_pct) != 2) ||
+                 (burst_pct > 100) )
+                goto usage;
+            opt_credit = SIM_MILLISECS(credit_ms);
+            opt_burst = burst_pct * (VDFS_RATIO_ONE / 100);
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if ( optind == argc )
+    {
+        static struct event sc_ev[SCENARIO_EVENTS];
+
+        for ( i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++ )
+            failed += !run_scenario(&scenarios[i], &r);
+        /* Cost on a scenario with both frequent switches and a cap. */
+        opt_credit = opt_burst = 0;
+        nr = build_scenario(&scenarios[COST_SCENARIO], sc_ev);
+        report_cost(&r, sc_ev, nr, 1, SCENARIO_LENGTH);
+        return failed ? 1 : 0;
+    }
+    if ( optind != argc - 1 )
+        goto usage;
+
+    f = strcmp(argv[optind], "-") ? fopen(argv[optind], "r") : stdin;
+    if ( f == NULL )
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+    if ( parse_trace(f, &ev, &nr, &nr_vcpus) )
+        return 1;
+    if ( nr == 0 )
+    {
+        fprintf(stderr, "%s: no events\n", argv[optind]);
+        return 1;
+    }
+
+    replay(&r, ev, nr, nr_vcpus, ev[nr - 1].time, opt_report, 1);
+    print_summary(&r);
+    report_cost(&r, ev, nr, nr_vcpus, ev[nr - 1].time);
+    free(ev);
+
+    return 0;
+
+ usage:
+    fprintf(stderr, "usage: %s [-h halflife_ms] [-m max_khz] [-r report_ms]"
+            " [-b credit_ms:burst_pct] [trace]\n", argv[0]);
+    return 2;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,232 @@
+/*
+ * vdfs_sim.h: the per-VCPU VDFS glue of xen/common/schedule.c, for
+ * userspace.
+ *
+ * The accounting, runstate updates, cap and commitments themselves are
+ * xen/vdfs.h's, which schedule.c calls too, seqcounts, barriers and wait
+ * histogram included; what is left here is what schedule.c wraps them in.
+ * Struct vcpu shrinks to struct sim_vcpu, and the schedule lock, timers,
+ * publishing and tracing go away: the programs here are single threaded
+ * and drive time themselves. The functions are named after their
+ * schedule.c counterparts in the comments.
+ */
+
+#ifndef __VDFS_SIM_H__
+#define __VDFS_SIM_H__
+
+#include <string.h>
+#include <xen/vdfs.h>
+
+#define SIM_RUNNING      RUNSTATE_running
+#define SIM_RUNNABLE     RUNSTATE_runnable
+#define SIM_BLOCKED      RUNSTATE_blocked
+#define SIM_OFFLINE      RUNSTATE_offline
+
+#define SIM_MILLISECS(ms) ((s_time_t)(ms) * 1000000)
+
+/* As VDFS_CAP_PERIOD. */
+#define SIM_CAP_PERIOD   SIM_MILLISECS(30)
+
+#define SIM_NR_CPUS      4
+
+struct sim {
+    struct vdfs_decay  decay;
+    s_time_t           fold_interval;
+    uint32_t           max_khz;
+    uint32_t           speed;       /* vdfs_cpu_speed() of every CPU */
+    int                accounting;  /* opt_vdfs_accounting */
+    struct vdfs_credit credit;      /* shared by all VCPUs, as per domain */
+
+    /* Calls, for per-call costs. */
+    unsigned long      changes;     /* runstate changes */
+    unsigned long      folds;       /* of which folded the averages */
+    unsigned long      reads;       /* lock-free reads of the averages */
+    unsigned long      periods;     /* cap periods */
+};
+
+/* The per-CPU vdfs_committed. */
+static atomic_t sim_committed[SIM_NR_CPUS];
+
+struct sim_vcpu {
+    struct vcpu_runstate_info runstate;
+    unsigned int       runstate_seq;
+
+    /* *v->vdfs, which Xen allocates on cache lines of its own. */
+    struct vcpu_vdfs   vdfs;
+
+    /* v->cap, and _VPF_capped */
+    struct vdfs_cap    cap;
+    int                capped;
+
+    unsigned int       processor;
+    unsigned int       vdfs_cpu, vdfs_commit;
+};
+
+/* scheduler_init() */
+static inline void sim_init(struct sim *s, s_time_t halflife, uint32_t max_khz)
+{
+    memset(s, 0, sizeof(*s));
+    memset(sim_committed, 0, sizeof(sim_committed));
+    vdfs_decay_init(&s->decay, halflife);
+    s->fold_interval = s->decay.halflife / 8;
+    s->max_khz = max_khz;
+    s->speed = VDFS_RATIO_ONE;
+    s->accounting = 1;
+}
+
+/* sched_init_vcpu(), on CPU 0 */
+static inline void sim_vcpu_init(struct sim_vcpu *v, int state, s_time_t now)
+{
+    memset(v, 0, sizeof(*v));
+    v->runstate.state = state;
+    v->runstate.state_entry_time = now;
+    vdfs_init(&v->vdfs, now);
+}
+
+/* vcpu_vdfs_account() */
+static inline void sim_account(struct sim *s, struct sim_vcpu *v, s_time_t now)
+{
+    if ( s->accounting &&
+         vdfs_account(&s->decay, &v->vdfs, &v->runstate, now) )
+        s->folds++;
+}
+
+/* vcpu_vdfs_read() */
+static inline void sim_read(struct sim *s, const struct sim_vcpu *v,
+                            s_time_t now, uint64_t time[VDFS_NR_STATES])
+{
+    vdfs_read(&s->decay, &v->vdfs, &v->runstate_seq, &v->runstate, now,
+              s->accounting, time);
+    s->reads++;
+}
+
+/* vcpu_vdfs_tick() */
+static inline void sim_tick(struct sim *s, struct sim_vcpu *v, s_time_t now)
+{
+    if ( !s->accounting ||
+         likely(!vdfs_account_due(&v->vdfs, now, s->fold_interval)) )
+        return;
+
+    sim_account(s, v, now);
+}
+
+/* vcpu_runstate_change() */
+static inline void sim_runstate_change(struct sim *s, struct sim_vcpu *v,
+                                       int new_state, s_time_t now)
+{
+    sim_tick(s, v, now);
+    vdfs_runstate_change(&v->runstate, &v->runstate_seq, new_state, now,
+                         &v->vdfs);
+    s->changes++;
+}
+
+static atomic_t *sim_committed_on(unsigned int cpu)
+{
+    return &sim_committed[cpu];
+}
+
+/* vcpu_vdfs_commit(), for a VCPU that is neither down nor paused. */
+static inline void sim_commit(struct sim_vcpu *v)
+{
+    vdfs_commit(&v->vdfs_cpu, &v->vdfs_commit, v->processor,
+                vdfs_demand(v->cap.target), sim_committed_on);
+}
+
+/*
+ * The context switch in schedule(): @prev, which was running, goes into
+ * @prev_state and @next runs.
+ */
+static inline void sim_switch(struct sim *s, struct sim_vcpu *prev,
+                              int prev_state, struct sim_vcpu *next,
+                              s_time_t now)
+{
+    sim_runstate_change(s, prev, prev_state, now);
+    sim_runstate_change(s, next, SIM_RUNNING, now);
+    sim_commit(next);
+}
+
+/* vcpu_dynamic_freq_get(): effective kHz, and the shares in @share[]. */
+static inline uint32_t sim_effective_khz(struct sim *s,
+                                         const struct sim_vcpu *v,
+                                         s_time_t now,
+                                         uint32_t share[VDFS_NR_STATES])
+{
+    uint64_t time[VDFS_NR_STATES];
+
+    sim_read(s, v, now, time);
+
+    return vdfs_effective_khz(s->max_khz, time, share);
+}
+
+/* vcpu_vdfs_throttled() */
+static inline uint64_t sim_throttled(const struct sim *s,
+                                     const struct sim_vcpu *v, s_time_t now,
+                                     uint64_t *throttled)
+{
+    return vdfs_throttled(&s->decay, &v->vdfs, now, throttled);
+}
+
+/* vcpu_vdfs_info_fill(): available kHz. */
+static inline uint32_t sim_available_khz(struct sim *s,
+                                         const struct sim_vcpu *v,
+                                         s_time_t now)
+{
+    uint64_t time[VDFS_NR_STATES], throttled;
+
+    sim_read(s, v, now, time);
+
+    return vdfs_available_khz(s->max_khz, time,
+                              sim_throttled(s, v, now, &throttled));
+}
+
+/* vcpu_running_time() */
+static inline s_time_t sim_running_time(const struct sim_vcpu *v, s_time_t now)
+{
+    return vdfs_running_time(&v->runstate, now);
+}
+
+/*
+ * vcpu_apply_target(), for @target parts per VDFS_RATIO_ONE. The caller
+ * releases the VCPU if the target is removed while it is capped.
+ */
+static inline void sim_apply_target(struct sim *s, struct sim_vcpu *v,
+                                    uint32_t target, s_time_t now)
+{
+    vdfs_cap_set(&v->cap, target, SIM_CAP_PERIOD, sim_running_time(v, now));
+    if ( target == 0 )
+        vdfs_throttle(&s->decay, &v->vdfs, now, 0);
+    sim_commit(v);
+}
+
+/*
+ * vcpu_cap_timer_fn(), for a VCPU with a target: returns whether @v is to
+ * be capped for the next period, which the caller applies to its runstate.
+ */
+static inline int sim_cap_period(struct sim *s, struct sim_vcpu *v,
+                                 s_time_t now)
+{
+    uint32_t share[VDFS_NR_STATES], measured;
+    int over;
+
+    sim_effective_khz(s, v, now, share);
+
+    over = vdfs_cap_period(&v->cap, SIM_CAP_PERIOD, share[SIM_RUNNING],
+                           s->speed, v->capped, sim_running_time(v, now),
+                           &s->credit, &measured);
+    vdfs_throttle(&s->decay, &v->vdfs, now, over);
+    s->periods++;
+
+    return over;
+}
+
+#endif /* __VDFS_SIM_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
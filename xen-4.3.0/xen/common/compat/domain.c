@@ -78,7 +78,15 @@ int compat_vcpu_op(int cmd, int vcpuid, XEN_GUEST_HANDLE_PARAM(void) arg)
      */
     case VCPUOP_get_dynamic_freq:
     case VCPUOP_set_target_freq:
+    case VCPUOP_register_vdfs_memory_area:
     case VCPUOP_send_nmi:
+    case VCPUOP_get_dynamic_freq_aggregate:
+    case VCPUOP_register_vdfs_notify:
+    case VCPUOP_get_vdfs_runstate:
+    case VCPUOP_get_wait_latency:
+    case VCPUOP_vdfs_burst:
+    /* Uses a 64-bit guest handle: the layout matches the native one. */
+    case VCPUOP_get_dynamic_freq_batch:
         rc = do_vcpu_op(cmd, vcpuid, arg);
         break;
 
@@ -61,23 +61,12 @@ struct domain *domain_list;
 
 struct domain *dom0;
 
-struct csched_dom {
-    struct list_head active_vcpu;
-    struct list_head active_sdom_elem;
-    struct domain *dom;
-    /* cpumask translated from the domain's node-affinity.
- *      * Basically, the CPUs we prefer to be scheduled on. */
-    cpumask_var_t node_affinity_cpumask;
-    uint16_t active_vcpu_count;
-    uint16_t weight;
-    uint16_t cap;
-    uint16_t sleep;
-};
-
 struct vcpu *idle_vcpu[NR_CPUS] __read_mostly;
 
 vcpu_info_t dummy_vcpu_info;
 
+static void unmap_vdfs_info(struct vcpu *v);
+
 int current_domain_id(void)
 {
     return current->domain->domain_id;
@@ -157,6 +146,7 @@ struct vcpu *alloc_vcpu(
                         ? (vcpu_info_t *)&shared_info(d, vcpu_info[vcpu_id])
                         : &dummy_vcpu_info);
         v->vcpu_info_mfn = INVALID_MFN;
+        v->vdfs_info_mfn = INVALID_MFN;
         init_waitqueue_vcpu(v);
     }
 
@@ -242,6 +232,7 @@ struct domain *domain_create(
     d->auto_node_affinity = 1;
 
     spin_lock_init(&d->shutdown_lock);
+    spin_lock_init(&d->vdfs_credit_lock);
     d->shutdown_code = -1;
 
     err = -ENOMEM;
@@ -554,7 +545,10 @@ int domain_kill(struct domain *d)
             break;
         }
         for_each_vcpu ( d, v )
+        {
             unmap_vcpu_info(v);
+            unmap_vdfs_info(v);
+        }
         d->is_dying = DOMDYING_dead;
         /* Mem event cleanup has to go here because the rings 
          * have to be put before we call put_domain. */
@@ -979,6 +973,70 @@ void unmap_vcpu_info(struct vcpu *v)
     put_page_and_type(mfn_to_page(mfn));
 }
 
+/*
+ * Map a guest page in and point the vcpu_vdfs_info pointer at it. Unlike
+ * vcpu_info, the area is only ever written by Xen, so any VCPU may register
+ * it on behalf of any other.
+ */
+static int map_vdfs_info(struct vcpu *v, unsigned long gfn, unsigned offset)
+{
+    struct domain *d = v->domain;
+    void *mapping;
+    struct page_info *page;
+
+    if ( offset > (PAGE_SIZE - sizeof(struct vcpu_vdfs_info)) )
+        return -EINVAL;
+
+    if ( v->vdfs_info_mfn != INVALID_MFN )
+        return -EINVAL;
+
+    page = get_page_from_gfn(d, gfn, NULL, P2M_ALLOC);
+    if ( !page )
+        return -EINVAL;
+
+    if ( !get_page_type(page, PGT_writable_page) )
+    {
+        put_page(page);
+        return -EINVAL;
+    }
+
+    mapping = __map_domain_page_global(page);
+    if ( mapping == NULL )
+    {
+        put_page_and_type(page);
+        return -ENOMEM;
+    }
+
+    memset(mapping + offset, 0, sizeof(struct vcpu_vdfs_info));
+    v->vdfs_info_mfn = page_to_mfn(page);
+
+    /* Clear the area /before/ the scheduler may start publishing into it. */
+    wmb();
+
+    v->vdfs_info = mapping + offset;
+
+    vcpu_vdfs_update(v);
+
+    return 0;
+}
+
+/* As unmap_vcpu_info(): only used once the domain's VCPUs are paused. */
+static void unmap_vdfs_info(struct vcpu *v)
+{
+    unsigned long mfn;
+
+    if ( v->vdfs_info_mfn == INVALID_MFN )
+        return;
+
+    mfn = v->vdfs_info_mfn;
+    unmap_domain_page_global(v->vdfs_info);
+
+    v->vdfs_info = NULL;
+    v->vdfs_info_mfn = INVALID_MFN;
+
+    put_page_and_type(mfn_to_page(mfn));
+}
+
 long do_vcpu_op(int cmd, int vcpuid, XEN_GUEST_HANDLE_PARAM(void) arg)
 {
     struct domain *d = current->domain;
@@ -1152,72 +1210,139 @@ long do_vcpu_op(int cmd, int vcpuid, XEN_GUEST_HANDLE_PARAM(void) arg)
      * This determines the functional frequency based on the usage
      */ 
     case VCPUOP_get_dynamic_freq:
+        if ( v->vcpu_info == &dummy_vcpu_info )
+            return -EINVAL;
+
+        if ( !guest_handle_is_null(arg) )
+        {
+            struct vcpu_vdfs_info info;
+
+            vcpu_vdfs_info_get(v, &info);
+            if ( copy_to_guest(arg, &info, 1) )
+                return -EFAULT;
+            rc = info.effective_khz;
+        }
+        else
+            rc = vcpu_dynamic_freq(v, NULL);
+        break;
+
+    case VCPUOP_get_dynamic_freq_batch:
     {
-        struct vcpu_info *vinfo;
-        struct vcpu_time_info u;
-	unsigned int ratio;
-        //unsigned long long total;
-        uint64_t total = 0;
-	uint64_t runi, runa, ofln, bloc;
-	long speed;
-
-	//calculate the max speed
-	//this code is based on the following formula:  
-	//((10^9 << 32) / tsc_to_system_mul) >> tsc_shift
-	
-	u64 freq, CONST = 1000000ULL << 32;
-	
-	if ( v->vcpu_info == &dummy_vcpu_info )
+        struct vcpu_dynamic_freq_batch batch;
+        struct vcpu_dynamic_freq freq;
+        unsigned int i;
+        struct vcpu *w;
+
+        if ( copy_from_guest(&batch, arg, 1) )
+            return -EFAULT;
+
+        if ( batch.first_vcpu >= d->max_vcpus )
             return -EINVAL;
-	
-	vinfo = (struct vcpu_info *)v->vcpu_info;
-	u = vinfo->time;
-	freq = u.tsc_to_system_mul;
-	freq = CONST/freq;
-	if (u.tsc_shift < 0)
-        	speed = freq << -u.tsc_shift;
-    	else
-        	speed  = freq >> u.tsc_shift;
-	
-	//obtain values for different runstate allocations
-	//divided by 100 to prevent overflow
-	//the 100's cancel out (runi / 100)/(total / 100) = runi / total
-	runi = v->avg_runstate.time[RUNSTATE_running] / 100;
-    	runa = v->avg_runstate.time[RUNSTATE_runnable] / 100;
-	ofln = v->avg_runstate.time[RUNSTATE_offline] / 100;
-    	bloc = v->avg_runstate.time[RUNSTATE_blocked] / 100;
-	total = runi + runa + ofln + bloc;
-
-	if (total == 0) //bounds checking
-          total = 1;
-
-
-	//large values multiplied to ratio to increase accuracy
-	//technically this is the percentage * 10000000
-        ratio = (runi * 1000000000) / total;
-	
-	//bounds checking
-    	if (ratio == 0)
-          ratio = 1000000000;
-    	
-	//apply ratio to the max speed
-	rc = (speed * ratio)/ 1000000000;
-	break;
+
+        if ( batch.nr_vcpus > d->max_vcpus - batch.first_vcpu )
+            batch.nr_vcpus = d->max_vcpus - batch.first_vcpu;
+
+        batch.timestamp = NOW();
+
+        for ( i = 0; i < batch.nr_vcpus; i++ )
+        {
+            w = d->vcpu[batch.first_vcpu + i];
+            if ( w != NULL )
+                vcpu_dynamic_freq_get(w, batch.timestamp, &freq);
+            else
+                memset(&freq, 0, sizeof(freq));
+
+            if ( copy_to_guest_offset(batch.freqs, i, &freq, 1) )
+                return -EFAULT;
+        }
+
+        if ( __copy_to_guest(arg, &batch, 1) )
+            rc = -EFAULT;
+        break;
+    }
+
+    case VCPUOP_get_dynamic_freq_aggregate:
+    {
+        struct vcpu_dynamic_freq_aggregate agg;
+
+        if ( copy_from_guest(&agg, arg, 1) )
+            return -EFAULT;
+
+        rc = vdfs_aggregate_get(&agg);
+        if ( !rc && __copy_to_guest(arg, &agg, 1) )
+            rc = -EFAULT;
+        break;
+    }
+
+    case VCPUOP_vdfs_burst:
+    {
+        struct vcpu_vdfs_burst burst;
+
+        if ( copy_from_guest(&burst, arg, 1) )
+            return -EFAULT;
+
+        rc = vdfs_burst_op(&burst);
+        if ( !rc && __copy_to_guest(arg, &burst, 1) )
+            rc = -EFAULT;
+        break;
+    }
+
+    case VCPUOP_register_vdfs_memory_area:
+    {
+        struct vcpu_register_vdfs_memory_area area;
+
+        rc = -EFAULT;
+        if ( copy_from_guest(&area, arg, 1) )
+            break;
+
+        domain_lock(d);
+        rc = map_vdfs_info(v, area.mfn, area.offset);
+        domain_unlock(d);
+
+        break;
+    }
+
+    case VCPUOP_get_wait_latency:
+    {
+        struct vcpu_wait_latency lat;
+
+        if ( copy_from_guest(&lat, arg, 1) )
+            return -EFAULT;
+
+        rc = vcpu_wait_latency_get(v, &lat);
+        if ( !rc && copy_to_guest(arg, &lat, 1) )
+            rc = -EFAULT;
+        break;
+    }
+
+    case VCPUOP_get_vdfs_runstate:
+    {
+        struct vcpu_vdfs_runstate rs;
+
+        vcpu_vdfs_runstate_get(v, &rs);
+        rc = copy_to_guest(arg, &rs, 1) ? -EFAULT : 0;
+        break;
+    }
+
+    case VCPUOP_register_vdfs_notify:
+    {
+        struct vcpu_register_vdfs_notify notify;
+
+        if ( copy_from_guest(&notify, arg, 1) )
+            return -EFAULT;
+
+        rc = vcpu_vdfs_notify_set(v, &notify);
+        break;
     }
 
-    /*Modified by Sawyer
-     *
-     *This changes the cap value to the value given to the hypercall
-     */
     case VCPUOP_set_target_freq:
     {
-	struct csched_dom *sdom;
-	uint16_t ratio;
-	if (copy_from_guest(&ratio, arg, 1))
-		return -EFAULT;
+        uint16_t ratio;
+
+        if ( copy_from_guest(&ratio, arg, 1) )
+            return -EFAULT;
 
-	sdom = ((struct csched_dom *) (d)->sched_priv);
-	sdom->cap = ratio;
+        rc = vcpu_set_target(v, ratio);
         break;
     }
 
@@ -37,6 +37,9 @@
 #include <xen/preempt.h>
 #include <public/sched.h>
 #include <xsm/xsm.h>
+#ifdef HAS_CPUFREQ
+#include <acpi/cpufreq/cpufreq.h>
+#endif
 
 /* opt_sched: scheduler - default to credit */
 static char __initdata opt_sched[10] = "credit";
@@ -54,11 +57,67 @@ boolean_param("sched_smt_power_savings", sched_smt_power_savings);
  * */
 int sched_ratelimit_us = SCHED_DEFAULT_RATELIMIT_US;
 integer_param("sched_ratelimit_us", sched_ratelimit_us);
+
+/*
+ * Half-life of the VDFS runstate averages: time spent in a state counts
+ * half as much vdfs_halflife_ms later.
+ */
+#define VDFS_DEFAULT_HALFLIFE_MS 32
+#define VDFS_MAX_HALFLIFE_MS     1000
+static unsigned int __read_mostly vdfs_halflife_ms = VDFS_DEFAULT_HALFLIFE_MS;
+integer_param("vdfs_halflife_ms", vdfs_halflife_ms);
+static struct vdfs_decay __read_mostly vdfs_decay;
+/* The scheduler folds a VCPU's averages at most this often. */
+static s_time_t __read_mostly vdfs_fold_interval;
+
+/*
+ * Boot with vdfs_accounting=0 to leave the runstate averages alone, e.g. to
+ * measure the cost of the accounting on the context switch path. The VDFS
+ * queries then report whatever the averages held at boot.
+ */
+static bool_t __read_mostly opt_vdfs_accounting = 1;
+boolean_param("vdfs_accounting", opt_vdfs_accounting);
+
+/* Period over which per-VCPU targets (vcpu_set_target()) are enforced. */
+#define VDFS_CAP_PERIOD          MILLISECS(30)
+
+/*
+ * A VCPU's target is lowered at most once per vdfs_ratelimit_us; requests
+ * in between are merged and the last one is applied when the interval is
+ * up. Raises and removals are applied at once, so that a VCPU never waits
+ * for the speed it asked for. 0 applies every request at once.
+ */
+#define VDFS_DEFAULT_RATELIMIT_US 30000
+#define VDFS_MAX_RATELIMIT_US     1000000
+static unsigned int __read_mostly vdfs_ratelimit_us = VDFS_DEFAULT_RATELIMIT_US;
+integer_param("vdfs_ratelimit_us", vdfs_ratelimit_us);
+
+/*
+ * Share of each CPU, in parts per VDFS_COMMIT_ONE, committed to the VCPUs
+ * placed on it: their frequency target, or the whole CPU for VCPUs without
+ * one. Down VCPUs and paused ones commit nothing. A VCPU's commitment
+ * follows v->processor lazily, see vcpu_vdfs_commit().
+ */
+static DEFINE_PER_CPU(atomic_t, vdfs_committed);
+
+/*
+ * Boot with vdfs_pstate (and cpufreq=xen:userspace) to run each CPU at the
+ * lowest P-state that meets the targets committed to it, instead of holding
+ * VCPUs to their targets at full speed with caps alone. The caps still cover
+ * whatever the P-state steps leave over.
+ */
+static bool_t __read_mostly opt_vdfs_pstate;
+boolean_param("vdfs_pstate", opt_vdfs_pstate);
+static struct timer vdfs_pstate_timer;
+
 /* Various timer handlers. */
 static void s_timer_fn(void *unused);
 static void vcpu_periodic_timer_fn(void *data);
 static void vcpu_singleshot_timer_fn(void *data);
 static void poll_timer_fn(void *data);
+static void vcpu_cap_timer_fn(void *data);
+static void vcpu_target_timer_fn(void *data);
+static void vdfs_pstate_timer_fn(void *unused);
 
 /* This is global for now so that private implementations can reach it */
 DEFINE_PER_CPU(struct schedule_data, schedule_data);
@@ -81,6 +140,18 @@ static struct scheduler __read_mostly ops;
 #define VCPU2OP(_v)   (DOM2OP((_v)->domain))
 #define VCPU2ONLINE(_v) cpupool_online_cpumask((_v)->domain->cpupool)
 
+/*
+ * VDFS trace records, in a scheduler class of their own. Each starts with
+ * the domain and VCPU ID; ratios are in parts per VCPU_VDFS_RATIO_ONE.
+ * tools/xentrace/xenvdfs turns them into per-domain timelines.
+ */
+#define TRC_SCHED_VDFS           4
+#define TRC_VDFS_TARGET  TRC_SCHED_CLASS_EVT(VDFS, 1) /* target, merged */
+#define TRC_VDFS_APPLY   TRC_SCHED_CLASS_EVT(VDFS, 2) /* target */
+#define TRC_VDFS_CAP     TRC_SCHED_CLASS_EVT(VDFS, 3) /* cap, measured, over */
+#define TRC_VDFS_SAMPLE  TRC_SCHED_CLASS_EVT(VDFS, 4) /* effective, available,
+                                                         max kHz */
+
 static inline void trace_runstate_change(struct vcpu *v, int new_state)
 {
     struct { uint32_t vcpu:16, domain:16; } d;
@@ -99,6 +170,78 @@ static inline void trace_runstate_change(struct vcpu *v, int new_state)
     __trace_var(event, 1/*tsc*/, sizeof(d), &d);
 }
 
+/*
+ * Blocked and capped VCPUs keep their share, as they are expected back
+ * within a period; down VCPUs and those of paused domains are not, and
+ * are recommitted when woken.
+ */
+static unsigned int vcpu_vdfs_demand(const struct vcpu *v)
+{
+    if ( is_idle_vcpu(v) || test_bit(_VPF_down, &v->pause_flags) ||
+         atomic_read(&v->pause_count) ||
+         atomic_read(&v->domain->pause_count) )
+        return 0;
+    return vdfs_demand(v->cap.target);
+}
+
+static atomic_t *vdfs_committed_on(unsigned int cpu)
+{
+    return &per_cpu(vdfs_committed, cpu);
+}
+
+/*
+ * Move @v's commitment to its current CPU and target. Called with @v's
+ * schedule lock held wherever the scheduler may have moved it or its target
+ * may have changed; schedulers that steal work set v->processor on their
+ * own, which is caught up when the VCPU is next switched in.
+ */
+static inline void vcpu_vdfs_commit(struct vcpu *v)
+{
+    vdfs_commit(&v->vdfs_cpu, &v->vdfs_commit, v->processor,
+                vcpu_vdfs_demand(v), vdfs_committed_on);
+}
+
+/* Share of @cpu left uncommitted if @v were placed there. */
+static int vdfs_cpu_headroom(const struct vcpu *v, unsigned int cpu)
+{
+    int free = VDFS_COMMIT_ONE - atomic_read(&per_cpu(vdfs_committed, cpu));
+
+    if ( cpu == v->vdfs_cpu )
+        free += v->vdfs_commit;
+
+    return free - vcpu_vdfs_demand(v);
+}
+
+/*
+ * Adjust the scheduler's choice of @cpu for @v. A VCPU with a frequency
+ * target stays where the scheduler put it if that CPU can still deliver the
+ * target on top of its other commitments. Otherwise it goes to the CPU that
+ * fits it most tightly, which leaves whole CPUs free for VCPUs that need
+ * them; if none fits, the scheduler's choice stands.
+ */
+static unsigned int vdfs_pick_cpu(const struct vcpu *v, unsigned int cpu)
+{
+    unsigned int i, best = cpu;
+    int free, best_free = INT_MAX;
+
+    if ( (v->cap.target == 0) || (vdfs_cpu_headroom(v, cpu) >= 0) )
+        return cpu;
+
+    for_each_cpu ( i, v->cpu_affinity )
+    {
+        if ( !cpumask_test_cpu(i, v->domain->cpupool->cpu_valid) )
+            continue;
+        free = vdfs_cpu_headroom(v, i);
+        if ( (free >= 0) && (free < best_free) )
+        {
+            best = i;
+            best_free = free;
+        }
+    }
+
+    return best;
+}
+
 static inline void trace_continue_running(struct vcpu *v)
 {
     struct { uint32_t vcpu:16, domain:16; } d;
@@ -137,11 +280,411 @@ static inline void vcpu_urgent_count_update(struct vcpu *v)
     }
 }
 
+#ifdef PERF_COUNTERS
+/*
+ * Cycles spent on runstate bookkeeping per context switch, and in the
+ * VDFS part of it, shown with the scheduler state ('r' debug key).
+ */
+struct vdfs_stats {
+    uint64_t changes;
+    uint64_t change_cycles;     /* vcpu_runstate_change() for prev and next */
+    uint64_t accounts;
+    uint64_t account_cycles;    /* vcpu_vdfs_account() */
+};
+static DEFINE_PER_CPU(struct vdfs_stats, vdfs_stats);
+
+#define vdfs_cycles() get_cycles()
+#define VDFS_STAT_ADD(what, start) do {                                   \
+    this_cpu(vdfs_stats).what##s++;                                       \
+    this_cpu(vdfs_stats).what##_cycles += get_cycles() - (start);         \
+} while ( 0 )
+
+static void vdfs_stats_dump(unsigned int cpu)
+{
+    const struct vdfs_stats *st = &per_cpu(vdfs_stats, cpu);
+
+    printk("  VDFS: %"PRIu64" switches, %"PRIu64" cycles/switch,"
+           " %"PRIu64" accounted, %"PRIu64" cycles each\n",
+           st->changes, st->changes ? st->change_cycles / st->changes : 0,
+           st->accounts, st->accounts ? st->account_cycles / st->accounts : 0);
+}
+#else
+#define vdfs_cycles() 0
+#define VDFS_STAT_ADD(what, start) ((void)(start))
+static inline void vdfs_stats_dump(unsigned int cpu) {}
+#endif
+
+/* Bring @v's averages up to @now. Called with @v's schedule lock held. */
+static void vcpu_vdfs_account(struct vcpu *v, s_time_t now)
+{
+    cycles_t start = vdfs_cycles();
+
+    if ( !opt_vdfs_accounting || is_idle_vcpu(v) ||
+         !vdfs_account(&vdfs_decay, v->vdfs, &v->runstate, now) )
+        return;
+
+    VDFS_STAT_ADD(account, start);
+}
+
+/* A consistent copy of @v's raw runstate counters, without its lock. */
+static void vcpu_runstate_snapshot(const struct vcpu *v,
+                                   struct vcpu_runstate_info *rs)
+{
+    vdfs_runstate_snapshot(&v->runstate_seq, &v->runstate, rs);
+}
+
+/*
+ * Decayed runstate times of @v as of @now, without taking its schedule
+ * lock. Readers therefore neither contend with the scheduler nor with each
+ * other.
+ */
+static void vcpu_vdfs_read(const struct vcpu *v, s_time_t now,
+                           uint64_t time[4])
+{
+    vdfs_read(&vdfs_decay, v->vdfs, &v->runstate_seq, &v->runstate, now,
+              opt_vdfs_accounting && !is_idle_vcpu(v), time);
+}
+
+/*
+ * Maximum speed (kHz) of the physical CPU backing @v, recovered from the
+ * TSC scaling in its vcpu_time_info: ((10^9 << 32) / mul) >> shift Hz.
+ */
+uint32_t vcpu_max_khz(struct vcpu *v)
+{
+    uint64_t khz;
+
+    if ( v->vcpu_info == &dummy_vcpu_info )
+        return 0;
+
+    khz = vdfs_tsc_khz(vcpu_info(v, time.tsc_to_system_mul),
+                       vcpu_info(v, time.tsc_shift));
+
+    return min_t(uint64_t, khz, ~0U);
+}
+
+/*
+ * Effective frequency (kHz) of @v, as of @now: its maximum speed scaled by
+ * the share of recent time it spent running. Samples of several VCPUs
+ * taken with the same @now are mutually consistent.
+ */
+void vcpu_dynamic_freq_get(struct vcpu *v, s_time_t now,
+                           struct vcpu_dynamic_freq *freq)
+{
+    uint64_t time[4];
+
+    vcpu_vdfs_read(v, now, time);
+
+    freq->max_khz = vcpu_max_khz(v);
+    freq->effective_khz = vdfs_effective_khz(freq->max_khz, time, freq->share);
+}
+
+/*
+ * Effective frequency (kHz) of @v now. If @ratio is non-NULL it receives
+ * the running share, in parts per VCPU_VDFS_RATIO_ONE.
+ */
+uint32_t vcpu_dynamic_freq(struct vcpu *v, uint32_t *ratio)
+{
+    struct vcpu_dynamic_freq freq;
+
+    vcpu_dynamic_freq_get(v, NOW(), &freq);
+
+    if ( ratio != NULL )
+        *ratio = freq.share[RUNSTATE_running] ? : VCPU_VDFS_RATIO_ONE;
+
+    return freq.effective_khz;
+}
+
+/*
+ * @v's decayed throttled time as of @now, and in @throttled its total,
+ * without its schedule lock, as vcpu_vdfs_read() does.
+ */
+static uint64_t vcpu_vdfs_throttled(const struct vcpu *v, s_time_t now,
+                                    uint64_t *throttled)
+{
+    return vdfs_throttled(&vdfs_decay, v->vdfs, now, throttled);
+}
+
+/* Fill in @info, but for its version, from @v's averages @time[] as of @now. */
+static void vcpu_vdfs_info_fill(struct vcpu *v, s_time_t now,
+                                const uint64_t time[4],
+                                struct vcpu_vdfs_info *info)
+{
+    uint32_t share[4];
+    uint64_t throttled;
+
+    info->timestamp = now;
+    info->refresh_us = vdfs_fold_interval / MICROSECS(1);
+    info->max_khz = vcpu_max_khz(v);
+    info->effective_khz = vdfs_effective_khz(info->max_khz, time, share);
+    info->running_ratio = share[RUNSTATE_running] ? : VCPU_VDFS_RATIO_ONE;
+    info->available_khz =
+        vdfs_available_khz(info->max_khz, time,
+                           vcpu_vdfs_throttled(v, now, &throttled));
+}
+
+void vcpu_vdfs_info_get(struct vcpu *v, struct vcpu_vdfs_info *info)
+{
+    uint64_t time[4];
+    s_time_t now = NOW();
+
+    memset(info, 0, sizeof(*info));
+    vcpu_vdfs_read(v, now, time);
+    vcpu_vdfs_info_fill(v, now, time, info);
+}
+
+/* Trace @v's frequencies as of its last fold. */
+static void trace_vdfs_sample(struct vcpu *v, s_time_t now)
+{
+    struct vcpu_vdfs_info snap;
+
+    if ( likely(!tb_init_done) )
+        return;
+
+    vcpu_vdfs_info_fill(v, now, v->vdfs->avg.time, &snap);
+    TRACE_5D(TRC_VDFS_SAMPLE, v->domain->domain_id, v->vcpu_id,
+             snap.effective_khz, snap.available_khz, snap.max_khz);
+}
+
+/*
+ * Refresh the guest's VCPUOP_register_vdfs_memory_area copy from @v's
+ * averages. Called with @v's schedule lock held.
+ */
+static void vcpu_vdfs_publish(struct vcpu *v, s_time_t now)
+{
+    struct vcpu_vdfs_info *info = v->vdfs_info, snap;
+
+    vcpu_vdfs_info_fill(v, now, v->vdfs->avg.time, &snap);
+
+    info->version++;
+    wmb();
+    info->refresh_us = snap.refresh_us;
+    info->timestamp = snap.timestamp;
+    info->max_khz = snap.max_khz;
+    info->effective_khz = snap.effective_khz;
+    info->running_ratio = snap.running_ratio;
+    info->available_khz = snap.available_khz;
+    wmb();
+    info->version++;
+}
+
+void vcpu_vdfs_update(struct vcpu *v)
+{
+    s_time_t now = NOW();
+
+    vcpu_schedule_lock_irq(v);
+    if ( v->vdfs_info != NULL )
+    {
+        vcpu_vdfs_account(v, now);
+        vcpu_vdfs_publish(v, now);
+    }
+    vcpu_schedule_unlock_irq(v);
+}
+
+/* Signal a VCPU's registered port, outside of the schedule lock. */
+static void vcpu_vdfs_notify_fn(unsigned long data)
+{
+    struct vcpu *v = (struct vcpu *)data;
+    unsigned int port = v->vdfs_notify_port;
+
+    if ( port != 0 )
+        evtchn_send(v->domain, port);
+}
+
+/*
+ * Check @v's effective frequency against its notification thresholds.
+ * Called with @v's schedule lock held, so the event is sent from a tasklet:
+ * delivering it may wake VCPUs and take schedule locks.
+ */
+static void vcpu_vdfs_notify_check(struct vcpu *v)
+{
+    uint32_t khz, share[4];
+
+    khz = vdfs_effective_khz(vcpu_max_khz(v), v->vdfs->avg.time, share);
+    if ( !vdfs_notify_due(v->vdfs_notify_khz, khz, v->vdfs_notify_below_khz,
+                          v->vdfs_notify_change) )
+        return;
+
+    v->vdfs_notify_khz = khz;
+    tasklet_schedule(&v->vdfs_notify_tasklet);
+}
+
+int vcpu_vdfs_notify_set(struct vcpu *v,
+                         const struct vcpu_register_vdfs_notify *notify)
+{
+    struct vcpu_dynamic_freq freq;
+    s_time_t now = NOW();
+
+    if ( (notify->port >= MAX_EVTCHNS(v->domain)) ||
+         (notify->change_pct > 100) )
+        return -EINVAL;
+
+    vcpu_dynamic_freq_get(v, now, &freq);
+
+    vcpu_schedule_lock_irq(v);
+    v->vdfs_notify_port = notify->port;
+    v->vdfs_notify_below_khz = notify->below_khz;
+    v->vdfs_notify_change = notify->change_pct * (VCPU_VDFS_RATIO_ONE / 100);
+    v->vdfs_notify_khz = freq.effective_khz;
+    vcpu_schedule_unlock_irq(v);
+
+    return 0;
+}
+
+/*
+ * Fold from the scheduler only once @v's averages are vdfs_fold_interval
+ * old, so that the context switch path usually pays for just a comparison.
+ * Keeps a registered shared area in step with the averages. Without
+ * accounting the stamp never moves, so nothing is done at all.
+ */
+static inline void vcpu_vdfs_tick(struct vcpu *v, s_time_t now)
+{
+    if ( !opt_vdfs_accounting ||
+         likely((now - v->vdfs->stamp) < vdfs_fold_interval) ||
+         is_idle_vcpu(v) )
+        return;
+
+    vcpu_vdfs_account(v, now);
+    trace_vdfs_sample(v, now);
+    if ( v->vdfs_info != NULL )
+        vcpu_vdfs_publish(v, now);
+    if ( v->vdfs_notify_port != 0 )
+        vcpu_vdfs_notify_check(v);
+}
+
+/* Add @d's online VCPUs, and their decayed runstate times, to @agg. */
+static void domain_vdfs_sum(struct domain *d,
+                            struct vcpu_dynamic_freq_aggregate *agg,
+                            uint64_t time[4])
+{
+    struct vcpu *v;
+    uint64_t vtime[4];
+    int i;
+
+    for_each_vcpu ( d, v )
+    {
+        if ( test_bit(_VPF_down, &v->pause_flags) )
+            continue;
+
+        vcpu_vdfs_read(v, agg->timestamp, vtime);
+        for ( i = 0; i < 4; i++ )
+            time[i] += vtime[i];
+
+        agg->max_khz += vcpu_max_khz(v);
+        agg->nr_vcpus++;
+    }
+
+    agg->nr_domains++;
+}
+
+/*
+ * Fill in @agg for the domain or cpupool it names, as of a single point in
+ * time, without taking any scheduler locks.
+ */
+long vdfs_aggregate_get(struct vcpu_dynamic_freq_aggregate *agg)
+{
+    struct domain *d;
+    struct cpupool *pool;
+    uint64_t time[4] = { 0 };
+
+    agg->timestamp = NOW();
+    agg->effective_khz = agg->max_khz = 0;
+    agg->nr_domains = agg->nr_vcpus = 0;
+
+    switch ( agg->type )
+    {
+    case VCPU_VDFS_AGG_domain:
+        if ( (d = rcu_lock_domain_by_any_id(agg->id)) == NULL )
+            return -ESRCH;
+        if ( (d != current->domain) && !is_control_domain(current->domain) )
+        {
+            rcu_unlock_domain(d);
+            return -EPERM;
+        }
+        domain_vdfs_sum(d, agg, time);
+        rcu_unlock_domain(d);
+        break;
+
+    case VCPU_VDFS_AGG_cpupool:
+        if ( !is_control_domain(current->domain) )
+            return -EPERM;
+        if ( (pool = cpupool_get_by_id(agg->id)) == NULL )
+            return -ESRCH;
+        rcu_read_lock(&domlist_read_lock);
+        for_each_domain_in_cpupool ( d, pool )
+            domain_vdfs_sum(d, agg, time);
+        rcu_read_unlock(&domlist_read_lock);
+        cpupool_put(pool);
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    if ( vdfs_shares(time, agg->share) )
+        agg->effective_khz = vdfs_scale_ratio(agg->max_khz,
+                                              agg->share[RUNSTATE_running]);
+    else
+        agg->effective_khz = agg->max_khz;
+
+    return 0;
+}
+
+long vdfs_burst_op(struct vcpu_vdfs_burst *op)
+{
+    struct domain *d;
+    long rc = 0;
+
+    if ( (d = rcu_lock_domain_by_any_id(op->domid)) == NULL )
+        return -ESRCH;
+
+    switch ( op->cmd )
+    {
+    case VCPU_VDFS_BURST_get:
+        if ( (d != current->domain) && !is_control_domain(current->domain) )
+        {
+            rc = -EPERM;
+            break;
+        }
+        spin_lock_irq(&d->vdfs_credit_lock);
+        op->credit_max_ns = d->vdfs_credit.max;
+        op->burst_pct = d->vdfs_credit.burst / (VCPU_VDFS_RATIO_ONE / 100);
+        op->credit_ns = d->vdfs_credit.balance;
+        spin_unlock_irq(&d->vdfs_credit_lock);
+        break;
+
+    case VCPU_VDFS_BURST_set:
+        if ( !is_control_domain(current->domain) )
+        {
+            rc = -EPERM;
+            break;
+        }
+        if ( (op->burst_pct > 100) || (op->credit_max_ns > STIME_MAX) )
+        {
+            rc = -EINVAL;
+            break;
+        }
+        spin_lock_irq(&d->vdfs_credit_lock);
+        d->vdfs_credit.max = op->credit_max_ns;
+        d->vdfs_credit.burst = op->burst_pct * (VCPU_VDFS_RATIO_ONE / 100);
+        if ( d->vdfs_credit.balance > d->vdfs_credit.max )
+            d->vdfs_credit.balance = d->vdfs_credit.max;
+        op->credit_ns = d->vdfs_credit.balance;
+        spin_unlock_irq(&d->vdfs_credit_lock);
+        break;
+
+    default:
+        rc = -EINVAL;
+        break;
+    }
+
+    rcu_unlock_domain(d);
+
+    return rc;
+}
+
 static inline void vcpu_runstate_change(
     struct vcpu *v, int new_state, s_time_t new_entry_time)
 {
-    s_time_t delta;
-
     ASSERT(v->runstate.state != new_state);
     ASSERT(spin_is_locked(per_cpu(schedule_data,v->processor).schedule_lock));
 
@@ -149,17 +692,11 @@ static inline void vcpu_runstate_change(
 
     trace_runstate_change(v, new_state);
 
-    delta = new_entry_time - v->runstate.state_entry_time;
-    if ( delta > 0 )
-    {
-        v->runstate.time[v->runstate.state] += delta;
-        v->runstate.state_entry_time = new_entry_time;
-	//Modified by Sawyer
-	//This calcualtes the running average allocation
-	v->avg_runstate.time[v->runstate.state] = ((v->runstate.time[v->runstate.state] * 7) + delta)/8;
-    }
+    vcpu_vdfs_tick(v, new_entry_time);
 
-    v->runstate.state = new_state;
+    /* Idle VCPUs' waits are not worth recording. */
+    vdfs_runstate_change(&v->runstate, &v->runstate_seq, new_state,
+                         new_entry_time, is_idle_vcpu(v) ? NULL : v->vdfs);
 }
 
 void vcpu_runstate_get(struct vcpu *v, struct vcpu_runstate_info *runstate)
@@ -194,11 +731,16 @@ int sched_init_vcpu(struct vcpu *v, unsigned int processor)
 {
     struct domain *d = v->domain;
 
+    if ( (v->vdfs = xzalloc(struct vcpu_vdfs)) == NULL )
+        return 1;
+    vdfs_init(v->vdfs, v->runstate.state_entry_time);
+
     /*
      * Initialize processor and affinity settings. The idler, and potentially
      * domain-0 VCPUs, are pinned onto their respective physical CPUs.
      */
     v->processor = processor;
+    v->vdfs_cpu = processor;
     if ( is_idle_domain(d) || d->is_pinned )
         cpumask_copy(v->cpu_affinity, cpumask_of(processor));
     else
@@ -211,6 +753,12 @@ int sched_init_vcpu(struct vcpu *v, unsigned int processor)
                v, v->processor);
     init_timer(&v->poll_timer, poll_timer_fn,
                v, v->processor);
+    init_timer(&v->cap_timer, vcpu_cap_timer_fn,
+               v, v->processor);
+    init_timer(&v->target_timer, vcpu_target_timer_fn,
+               v, v->processor);
+    softirq_tasklet_init(&v->vdfs_notify_tasklet, vcpu_vdfs_notify_fn,
+                         (unsigned long)v);
 
     /* Idle VCPUs are scheduled immediately. */
     if ( is_idle_domain(d) )
@@ -223,8 +771,13 @@ int sched_init_vcpu(struct vcpu *v, unsigned int processor)
 
     v->sched_priv = SCHED_OP(DOM2OP(d), alloc_vdata, v, d->sched_priv);
     if ( v->sched_priv == NULL )
+    {
+        xfree(v->vdfs);
+        v->vdfs = NULL;
         return 1;
+    }
 
+    vcpu_vdfs_commit(v);
     SCHED_OP(DOM2OP(d), insert_vcpu, v);
 
     return 0;
@@ -288,9 +841,12 @@ int sched_move_domain(struct domain *d, struct cpupool *c)
         migrate_timer(&v->periodic_timer, new_p);
         migrate_timer(&v->singleshot_timer, new_p);
         migrate_timer(&v->poll_timer, new_p);
+        migrate_timer(&v->cap_timer, new_p);
+        migrate_timer(&v->target_timer, new_p);
 
         cpumask_setall(v->cpu_affinity);
         v->processor = new_p;
+        vcpu_vdfs_commit(v);
         v->sched_priv = vcpu_priv[v->vcpu_id];
         evtchn_move_pirqs(v);
 
@@ -317,10 +873,15 @@ void sched_destroy_vcpu(struct vcpu *v)
     kill_timer(&v->periodic_timer);
     kill_timer(&v->singleshot_timer);
     kill_timer(&v->poll_timer);
+    kill_timer(&v->cap_timer);
+    kill_timer(&v->target_timer);
+    tasklet_kill(&v->vdfs_notify_tasklet);
     if ( test_and_clear_bool(v->is_urgent) )
         atomic_dec(&per_cpu(schedule_data, v->processor).urgent_count);
     SCHED_OP(VCPU2OP(v), remove_vcpu, v);
     SCHED_OP(VCPU2OP(v), free_vdata, v->sched_priv);
+    atomic_sub(v->vdfs_commit, &per_cpu(vdfs_committed, v->vdfs_cpu));
+    xfree(v->vdfs);
 }
 
 int sched_init_domain(struct domain *d)
@@ -348,6 +909,7 @@ void vcpu_sleep_nosync(struct vcpu *v)
 
         SCHED_OP(VCPU2OP(v), sleep, v);
     }
+    vcpu_vdfs_commit(v);
 
     vcpu_schedule_unlock_irqrestore(v, flags);
 
@@ -381,6 +943,7 @@ void vcpu_wake(struct vcpu *v)
         if ( v->runstate.state == RUNSTATE_blocked )
             vcpu_runstate_change(v, RUNSTATE_offline, NOW());
     }
+    vcpu_vdfs_commit(v);
 
     vcpu_schedule_unlock_irqrestore(v, flags);
 
@@ -459,7 +1022,7 @@ static void vcpu_migrate(struct vcpu *v)
                 break;
 
             /* Select a new CPU. */
-            new_cpu = SCHED_OP(VCPU2OP(v), pick_cpu, v);
+            new_cpu = vdfs_pick_cpu(v, SCHED_OP(VCPU2OP(v), pick_cpu, v));
             if ( (new_lock == per_cpu(schedule_data, new_cpu).schedule_lock) &&
                  cpumask_test_cpu(new_cpu, v->domain->cpupool->cpu_valid) )
                 break;
@@ -512,6 +1075,7 @@ static void vcpu_migrate(struct vcpu *v)
         SCHED_OP(VCPU2OP(v), migrate, v, new_cpu);
     else
         v->processor = new_cpu;
+    vcpu_vdfs_commit(v);
 
 
     if ( old_lock != new_lock )
@@ -1086,6 +1650,331 @@ long sched_adjust(struct domain *d, struct xen_domctl_scheduler_op *op)
     return ret;
 }
 
+/* Running time of @v up to @now, including the current stint. */
+static s_time_t vcpu_running_time(struct vcpu *v, s_time_t now)
+{
+    return vdfs_running_time(&v->runstate, now);
+}
+
+/*
+ * Account the time @v has been parked by its cap up to @now and fold it
+ * into the decayed average; @parked says whether it stays parked from now
+ * on. Called with @v's schedule lock held, at least once per cap period
+ * while @v has a target.
+ */
+static void vcpu_vdfs_throttle(struct vcpu *v, s_time_t now, bool_t parked)
+{
+    vdfs_throttle(&vdfs_decay, v->vdfs, now, parked);
+}
+
+void vcpu_vdfs_runstate_get(struct vcpu *v, struct vcpu_vdfs_runstate *rs)
+{
+    struct vcpu_runstate_info runstate;
+    uint64_t time[4], total = 0, throttled, avg;
+    s_time_t now;
+    int i;
+
+    memset(rs, 0, sizeof(*rs));
+
+    vcpu_runstate_snapshot(v, &runstate);
+    now = NOW();
+    avg = vcpu_vdfs_throttled(v, now, &throttled);
+
+    if ( now > runstate.state_entry_time )
+        runstate.time[runstate.state] += now - runstate.state_entry_time;
+    vcpu_vdfs_read(v, now, time);
+
+    rs->timestamp = now;
+    for ( i = 0; i < 4; i++ )
+    {
+        rs->time[i] = runstate.time[i];
+        total += time[i];
+    }
+    rs->throttled = throttled;
+    vdfs_shares(time, rs->share);
+    rs->throttled_share = vdfs_ratio(avg, total);
+    rs->available_khz = vdfs_available_khz(vcpu_max_khz(v), time, avg);
+}
+
+/*
+ * Add @v's waits to @hist[], without its schedule lock: each bucket is
+ * read whole, though the buckets may be a few switches apart.
+ */
+static void vcpu_wait_hist_add(const struct vcpu *v,
+                               uint64_t hist[VDFS_HIST_BUCKETS])
+{
+    vdfs_wait_hist_add(v->vdfs, hist);
+}
+
+/*
+ * The domain scope sums the VCPUs' histograms here, rather than have every
+ * context switch update a shared one as well.
+ */
+int vcpu_wait_latency_get(struct vcpu *v, struct vcpu_wait_latency *lat)
+{
+    uint64_t hist[VDFS_HIST_BUCKETS] = { 0 };
+    uint64_t total = 0;
+    struct vcpu *w;
+    unsigned int i;
+
+    switch ( lat->scope )
+    {
+    case VCPU_WAIT_vcpu:
+        vcpu_wait_hist_add(v, hist);
+        break;
+    case VCPU_WAIT_domain:
+        for_each_vcpu ( v->domain, w )
+            vcpu_wait_hist_add(w, hist);
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    lat->max_ns = 0;
+    for ( i = 0; i < VDFS_HIST_BUCKETS; i++ )
+    {
+        total += hist[i];
+        if ( hist[i] )
+            lat->max_ns = vdfs_hist_floor(i + 1);
+    }
+
+    lat->count = total;
+    lat->p50_ns = vdfs_hist_quantile(hist, total, 500000);
+    lat->p99_ns = vdfs_hist_quantile(hist, total, 990000);
+    lat->p999_ns = vdfs_hist_quantile(hist, total, 999000);
+
+    return 0;
+}
+
+/*
+ * Make @target, in parts per VCPU_VDFS_RATIO_ONE, @v's target. This works
+ * for every scheduler: @v is capped at a share of each VDFS_CAP_PERIOD and,
+ * once that share is overrun, taken off the runqueue in the same way as a
+ * paused VCPU until later periods have paid the overrun off. The cap starts
+ * at @target and is then steered by vcpu_cap_timer_fn() so that the
+ * measured effective frequency converges on it.
+ */
+static void vcpu_apply_target(struct vcpu *v, s_time_t now)
+{
+    uint32_t old, target;
+
+    vcpu_schedule_lock_irq(v);
+    /* The last request wins, whichever path gets here last. */
+    target = v->target_next;
+    old = v->cap.target;
+    vdfs_cap_set(&v->cap, target, VDFS_CAP_PERIOD, vcpu_running_time(v, now));
+    if ( target == 0 )
+        vcpu_vdfs_throttle(v, now, 0);
+    vcpu_vdfs_commit(v);
+    vcpu_schedule_unlock_irq(v);
+
+    TRACE_3D(TRC_VDFS_APPLY, v->domain->domain_id, v->vcpu_id, target);
+
+    if ( target == 0 )
+    {
+        stop_timer(&v->cap_timer);
+        if ( test_and_clear_bit(_VPF_capped, &v->pause_flags) )
+            vcpu_wake(v);
+    }
+    else if ( old == 0 )
+        set_timer(&v->cap_timer, now + VDFS_CAP_PERIOD);
+}
+
+/* Apply the last target requested for a VCPU since it was last applied. */
+static void vcpu_target_timer_fn(void *data)
+{
+    struct vcpu *v = data;
+    s_time_t now = NOW();
+
+    vcpu_schedule_lock_irq(v);
+    if ( !v->target_pending )
+    {
+        vcpu_schedule_unlock_irq(v);
+        return;
+    }
+    v->target_pending = 0;
+    v->target_applied = now;
+    vcpu_schedule_unlock_irq(v);
+
+    vcpu_apply_target(v, now);
+}
+
+/*
+ * Ask for @v to run at @target percent of its maximum speed; 0 or 100
+ * removes the target. Requests to lower the target are rate limited by
+ * vdfs_ratelimit_us, so they may only take effect later, and one that is
+ * superseded before then never does. Requests to raising or remove it take
+ * effect at once, superseding any pending one.
+ */
+int vcpu_set_target(struct vcpu *v, unsigned int target)
+{
+    s_time_t now = NOW(), due;
+    bool_t merged, raising;
+
+    if ( target > 100 )
+        return -EINVAL;
+    if ( target == 100 )
+        target = 0;
+    target *= VCPU_VDFS_RATIO_ONE / 100;
+
+    vcpu_schedule_lock_irq(v);
+    raising = (target == 0) ||
+              ((v->cap.target != 0) && (target > v->cap.target));
+    merged = v->target_pending;
+    v->target_pending = !raising;
+    v->target_next = target;
+    if ( raising )
+        v->target_applied = now;
+    due = v->target_applied + MICROSECS(vdfs_ratelimit_us);
+    vcpu_schedule_unlock_irq(v);
+
+    TRACE_4D(TRC_VDFS_TARGET, v->domain->domain_id, v->vcpu_id,
+             target, merged);
+    atomic_inc(&v->domain->vdfs_target_requests);
+    if ( merged )
+        /* A pending target is replaced, or goes along with this one. */
+        atomic_inc(&v->domain->vdfs_target_merged);
+    if ( raising )
+        vcpu_apply_target(v, now);
+    else if ( !merged )
+    {
+        if ( now < due )
+            set_timer(&v->target_timer, due);
+        else
+            vcpu_target_timer_fn(v);
+    }
+
+    return 0;
+}
+
+/*
+ * Per-VCPU cap accounting: steer the cap towards the target, charge the
+ * period that has just ended against the budget, and park or release the
+ * VCPU accordingly.
+ */
+#ifdef HAS_CPUFREQ
+/* Current speed of @cpu in parts per VCPU_VDFS_RATIO_ONE of its maximum. */
+static uint32_t vdfs_cpu_speed(unsigned int cpu)
+{
+    const struct cpufreq_policy *policy = per_cpu(cpufreq_cpu_policy, cpu);
+
+    if ( !opt_vdfs_pstate || (policy == NULL) ||
+         (policy->cpuinfo.max_freq == 0) || (policy->cur == 0) )
+        return VCPU_VDFS_RATIO_ONE;
+
+    return vdfs_ratio(policy->cur, policy->cpuinfo.max_freq);
+}
+
+/*
+ * Ask for the lowest frequency of @policy's P-state domain that covers the
+ * most committed CPU in it.
+ */
+static void vdfs_pstate_update(struct cpufreq_policy *policy)
+{
+    unsigned int i, freq, need = 0;
+
+    for_each_cpu ( i, policy->cpus )
+        need = max_t(unsigned int, need,
+                     atomic_read(&per_cpu(vdfs_committed, i)));
+    need = min_t(unsigned int, need, VDFS_COMMIT_ONE);
+
+    freq = vdfs_muldiv64(policy->cpuinfo.max_freq, need, VDFS_COMMIT_ONE);
+    if ( freq < policy->min )
+        freq = policy->min;
+    if ( freq > policy->max )
+        freq = policy->max;
+
+    if ( freq != policy->cur )
+        __cpufreq_driver_target(policy, freq, CPUFREQ_RELATION_L);
+}
+#else
+static uint32_t vdfs_cpu_speed(unsigned int cpu)
+{
+    return VCPU_VDFS_RATIO_ONE;
+}
+#endif
+
+/*
+ * Periodically re-aim the P-states at the committed targets. This runs from
+ * a timer rather than where commitments change, as those paths hold
+ * schedule locks and the cpufreq driver may have to IPI the CPUs whose
+ * frequency it changes.
+ */
+static void vdfs_pstate_timer_fn(void *unused)
+{
+#ifdef HAS_CPUFREQ
+    struct cpufreq_policy *policy;
+    unsigned int cpu;
+
+    if ( (cpufreq_controller == FREQCTL_xen) && get_cpu_maps() )
+    {
+        for_each_online_cpu ( cpu )
+        {
+            policy = per_cpu(cpufreq_cpu_policy, cpu);
+            if ( (policy != NULL) && (policy->cpu == cpu) &&
+                 (policy->cpuinfo.max_freq != 0) )
+                vdfs_pstate_update(policy);
+        }
+        put_cpu_maps();
+    }
+#endif
+
+    set_timer(&vdfs_pstate_timer, NOW() + VDFS_CAP_PERIOD);
+}
+
+static void vcpu_cap_timer_fn(void *data)
+{
+    struct vcpu *v = data;
+    struct vcpu_dynamic_freq freq;
+    s_time_t now = NOW();
+    uint32_t measured;
+    bool_t over, park = 0, release = 0;
+
+    vcpu_dynamic_freq_get(v, now, &freq);
+
+    vcpu_schedule_lock_irq(v);
+
+    if ( v->cap.target == 0 )
+    {
+        vcpu_vdfs_throttle(v, now, 0);
+        vcpu_schedule_unlock_irq(v);
+        if ( test_and_clear_bit(_VPF_capped, &v->pause_flags) )
+            vcpu_wake(v);
+        return;
+    }
+
+    spin_lock(&v->domain->vdfs_credit_lock);
+    over = vdfs_cap_period(&v->cap, VDFS_CAP_PERIOD,
+                           freq.share[RUNSTATE_running],
+                           vdfs_cpu_speed(v->processor),
+                           test_bit(_VPF_capped, &v->pause_flags),
+                           vcpu_running_time(v, now),
+                           &v->domain->vdfs_credit, &measured);
+    spin_unlock(&v->domain->vdfs_credit_lock);
+    vcpu_vdfs_throttle(v, now, over);
+    TRACE_5D(TRC_VDFS_CAP, v->domain->domain_id, v->vcpu_id,
+             v->cap.cap, measured, over);
+
+    /*
+     * Flip _VPF_capped and re-arm under the lock, so that a concurrent
+     * vcpu_apply_target() removing the target, whose stop_timer() cannot
+     * stop this handler, either comes first and is seen above, or comes
+     * after and releases @v and stops the timer itself.
+     */
+    if ( over )
+        park = !test_and_set_bit(_VPF_capped, &v->pause_flags);
+    else
+        release = test_and_clear_bit(_VPF_capped, &v->pause_flags);
+    set_timer(&v->cap_timer, now + VDFS_CAP_PERIOD);
+
+    vcpu_schedule_unlock_irq(v);
+
+    if ( park )
+        vcpu_sleep_nosync(v);
+    else if ( release )
+        vcpu_wake(v);
+}
+
 long sched_adjust_global(struct xen_sysctl_scheduler_op *op)
 {
     struct cpupool *pool;
@@ -1147,6 +2036,7 @@ static void schedule(void)
     struct schedule_data *sd;
     struct task_slice     next_slice;
     int cpu = smp_processor_id();
+    cycles_t              start;
 
     ASSERT_NOT_IN_ATOMIC();
 
@@ -1188,6 +2078,8 @@ static void schedule(void)
 
     if ( unlikely(prev == next) )
     {
+        /* Keep VDFS figures current for VCPUs that rarely switch out. */
+        vcpu_vdfs_tick(prev, now);
         pcpu_schedule_unlock_irq(cpu);
         trace_continue_running(next);
         return continue_running(prev);
@@ -1207,6 +2099,7 @@ static void schedule(void)
              prev->domain->domain_id, prev->vcpu_id,
              next->domain->domain_id, next->vcpu_id);
 
+    start = vdfs_cycles();
     vcpu_runstate_change(
         prev,
         (test_bit(_VPF_blocked, &prev->pause_flags) ? RUNSTATE_blocked :
@@ -1216,6 +2109,7 @@ static void schedule(void)
 
     ASSERT(next->runstate.state != RUNSTATE_running);
     vcpu_runstate_change(next, RUNSTATE_running, now);
+    VDFS_STAT_ADD(change, start);
 
     /*
      * NB. Don't add any trace records from here until the actual context
@@ -1224,6 +2118,7 @@ static void schedule(void)
 
     ASSERT(!next->is_running);
     next->is_running = 1;
+    vcpu_vdfs_commit(next);
 
     pcpu_schedule_unlock_irq(cpu);
 
@@ -1397,6 +2292,32 @@ void __init scheduler_init(void)
         sched_ratelimit_us = SCHED_DEFAULT_RATELIMIT_US;
     }
 
+    if ( vdfs_halflife_ms == 0 || vdfs_halflife_ms > VDFS_MAX_HALFLIFE_MS )
+    {
+        printk("WARNING: vdfs_halflife_ms outside of valid range [1,%d].\n"
+               " Resetting to default %u\n",
+               VDFS_MAX_HALFLIFE_MS, VDFS_DEFAULT_HALFLIFE_MS);
+        vdfs_halflife_ms = VDFS_DEFAULT_HALFLIFE_MS;
+    }
+    if ( vdfs_ratelimit_us > VDFS_MAX_RATELIMIT_US )
+    {
+        printk("WARNING: vdfs_ratelimit_us outside of valid range [0,%d].\n"
+               " Resetting to default %u\n",
+               VDFS_MAX_RATELIMIT_US, VDFS_DEFAULT_RATELIMIT_US);
+        vdfs_ratelimit_us = VDFS_DEFAULT_RATELIMIT_US;
+    }
+
+    vdfs_decay_init(&vdfs_decay, MILLISECS(vdfs_halflife_ms));
+    vdfs_fold_interval = vdfs_decay.halflife / 8;
+    BUILD_BUG_ON(VDFS_RATIO_ONE != VCPU_VDFS_RATIO_ONE);
+    BUILD_BUG_ON(VDFS_RUNNING != RUNSTATE_running);
+    BUILD_BUG_ON(VDFS_RUNNABLE != RUNSTATE_runnable);
+    if ( opt_vdfs_pstate )
+    {
+        init_timer(&vdfs_pstate_timer, vdfs_pstate_timer_fn, NULL, 0);
+        set_timer(&vdfs_pstate_timer, NOW() + VDFS_CAP_PERIOD);
+    }
+
     idle_domain = domain_create(DOMID_IDLE, 0, 0);
     BUG_ON(IS_ERR(idle_domain));
     idle_domain->vcpu = idle_vcpu;
@@ -1486,6 +2407,28 @@ void scheduler_free(struct scheduler *sched)
     xfree(sched);
 }
 
+static void vdfs_targets_dump(struct cpupool *c)
+{
+    struct domain *d;
+    bool_t header = 0;
+
+    rcu_read_lock(&domlist_read_lock);
+    for_each_domain_in_cpupool ( d, c )
+    {
+        if ( atomic_read(&d->vdfs_target_requests) == 0 )
+            continue;
+        if ( !header )
+        {
+            printk("VDFS target requests (merged):\n");
+            header = 1;
+        }
+        printk("  d%d: %d (%d)\n", d->domain_id,
+               atomic_read(&d->vdfs_target_requests),
+               atomic_read(&d->vdfs_target_merged));
+    }
+    rcu_read_unlock(&domlist_read_lock);
+}
+
 void schedule_dump(struct cpupool *c)
 {
     int               i;
@@ -1502,8 +2445,11 @@ void schedule_dump(struct cpupool *c)
         pcpu_schedule_lock(i);
         printk("CPU[%02d] ", i);
         SCHED_OP(sched, dump_cpu_state, i);
+        vdfs_stats_dump(i);
         pcpu_schedule_unlock(i);
     }
+
+    vdfs_targets_dump(c);
 }
 
 void sched_tick_suspend(void)
@@ -191,8 +191,26 @@ DEFINE_XEN_GUEST_HANDLE(vcpu_register_vcpu_info_t);
 /*Modified by Sawyer
  *These are the headers for the two custom hypercalls
  */
+/*
+ * Return the VCPU's effective frequency in kHz: its maximum speed scaled by
+ * the share of time it spent running, however little work it had. If
+ * @extra_arg is not NULL, it points to a vcpu_vdfs_info that is filled in
+ * as the VCPUOP_register_vdfs_memory_area copy would be, including the
+ * speed the VCPU would get if it had work (@available_khz).
+ */
 #define VCPUOP_get_dynamic_freq      14
 
+/*
+ * Ask for the given VCPU to run at a percentage of its maximum speed (0 or
+ * 100: no target), independently of the domain's other VCPUs and of the
+ * scheduler in use. Xen adjusts the VCPU's cap every period until the
+ * effective frequency reported by VCPUOP_get_dynamic_freq matches.
+ * Xen lowers a target at most once per rate-limit interval (boot parameter
+ * vdfs_ratelimit_us); a lower target asked for sooner takes effect when the
+ * interval is up, unless a later request replaces it first. Raising or
+ * removing the target takes effect at once.
+ * @extra_arg == pointer to a uint16_t.
+ */
 #define VCPUOP_set_target_freq      15
 
 /* Send an NMI to the specified VCPU. @extra_arg == NULL. */
@@ -241,6 +259,189 @@ struct vcpu_register_time_memory_area {
 typedef struct vcpu_register_time_memory_area vcpu_register_time_memory_area_t;
 DEFINE_XEN_GUEST_HANDLE(vcpu_register_time_memory_area_t);
 
+/*
+ * Register a memory location in the guest address space in which Xen
+ * publishes the VCPU's effective frequency, as returned by
+ * VCPUOP_get_dynamic_freq, so that it can be read without a hypercall.
+ * The area is versioned like vcpu_time_info: the version is odd while an
+ * update is in progress, and readers must retry if it is odd or changed
+ * across their read. The structure must not cross a page boundary.
+ *
+ * Xen refreshes the area when the VCPU changes state or is rescheduled,
+ * at most once per @refresh_us, and not at all while the VCPU stays
+ * blocked or waiting to run. The figures are as of @timestamp; readers that
+ * find it more than a few @refresh_us old should use
+ * VCPUOP_get_dynamic_freq, which is always current.
+ *
+ * This may be called only once per vcpu.
+ */
+#define VCPUOP_register_vdfs_memory_area 16 /* arg == vcpu_register_vdfs_memory_area_t */
+struct vcpu_vdfs_info {
+    uint32_t version;
+    uint32_t refresh_us;    /* Shortest interval between updates. */
+    uint64_t timestamp;     /* System time (ns) of the last update. */
+    uint32_t max_khz;       /* Speed of the underlying physical CPU. */
+    uint32_t effective_khz; /* max_khz scaled by the running share. */
+    uint32_t running_ratio; /* Running share, parts per VCPU_VDFS_RATIO_ONE. */
+    uint32_t available_khz; /* max_khz scaled by the share of the time the
+                               VCPU wanted to run that it did run. */
+};
+typedef struct vcpu_vdfs_info vcpu_vdfs_info_t;
+DEFINE_XEN_GUEST_HANDLE(vcpu_vdfs_info_t);
+#define VCPU_VDFS_RATIO_ONE 1000000000U
+
+struct vcpu_register_vdfs_memory_area {
+    uint64_t mfn;    /* mfn of page to place vcpu_vdfs_info */
+    uint32_t offset; /* offset within page */
+    uint32_t rsvd;   /* unused */
+};
+typedef struct vcpu_register_vdfs_memory_area vcpu_register_vdfs_memory_area_t;
+DEFINE_XEN_GUEST_HANDLE(vcpu_register_vdfs_memory_area_t);
+
+/*
+ * Return the effective frequency of a range of the caller's VCPUs in a
+ * single call. All entries are sampled at the same system time, returned
+ * in @timestamp. Entries for VCPUs that do not exist are zeroed.
+ * @vcpuid must name any valid VCPU of the caller; it is otherwise ignored.
+ * The layout is the same for 32- and 64-bit guests.
+ */
+#define VCPUOP_get_dynamic_freq_batch 17 /* arg == vcpu_dynamic_freq_batch_t */
+struct vcpu_dynamic_freq {
+    uint32_t effective_khz;
+    uint32_t max_khz;
+    /* Share of time in each RUNSTATE_*, parts per VCPU_VDFS_RATIO_ONE. */
+    uint32_t share[4];
+};
+typedef struct vcpu_dynamic_freq vcpu_dynamic_freq_t;
+DEFINE_XEN_GUEST_HANDLE(vcpu_dynamic_freq_t);
+
+struct vcpu_dynamic_freq_batch {
+    /* IN */
+    uint32_t first_vcpu;
+    /* IN: entries available in @freqs. OUT: entries written. */
+    uint32_t nr_vcpus;
+    /* OUT */
+    uint64_t timestamp;
+    XEN_GUEST_HANDLE_64(vcpu_dynamic_freq_t) freqs;
+};
+typedef struct vcpu_dynamic_freq_batch vcpu_dynamic_freq_batch_t;
+DEFINE_XEN_GUEST_HANDLE(vcpu_dynamic_freq_batch_t);
+
+/*
+ * Aggregate effective frequency of a whole domain or cpupool, summed over
+ * its online VCPUs and sampled at a single point in time, in one hypercall
+ * rather than one per VCPU. The @vcpuid argument is ignored. Querying
+ * another domain, or a cpupool, is restricted to the control domain.
+ */
+#define VCPUOP_get_dynamic_freq_aggregate 18 /* arg == vcpu_dynamic_freq_aggregate_t */
+#define VCPU_VDFS_AGG_domain  0
+#define VCPU_VDFS_AGG_cpupool 1
+struct vcpu_dynamic_freq_aggregate {
+    /* IN */
+    uint32_t type;          /* VCPU_VDFS_AGG_* */
+    uint32_t id;            /* domid, DOMID_SELF, or cpupool id */
+    /* OUT */
+    uint64_t timestamp;
+    uint64_t effective_khz; /* sum over the VCPUs */
+    uint64_t max_khz;       /* sum over the VCPUs */
+    uint32_t nr_domains;
+    uint32_t nr_vcpus;
+    /* Share of time in each RUNSTATE_*, parts per VCPU_VDFS_RATIO_ONE. */
+    uint32_t share[4];
+};
+typedef struct vcpu_dynamic_freq_aggregate vcpu_dynamic_freq_aggregate_t;
+DEFINE_XEN_GUEST_HANDLE(vcpu_dynamic_freq_aggregate_t);
+
+/*
+ * Ask to be notified when the VCPU's effective frequency drops below
+ * @below_khz, or moves by more than @change_pct percent from where it was
+ * when last notified (or registered). Xen signals @port as if the domain
+ * had sent on it with EVTCHNOP_send, so the notification arrives at the
+ * port's remote end; to receive it in the guest itself, bind @port to a
+ * loopback interdomain channel. The effective frequency is re-evaluated as
+ * the VCPU is scheduled, every few milliseconds while it is busy.
+ * A zero @port stops notifications; a zero threshold is ignored.
+ */
+#define VCPUOP_register_vdfs_notify 19 /* arg == vcpu_register_vdfs_notify_t */
+struct vcpu_register_vdfs_notify {
+    uint32_t port;
+    uint32_t below_khz;
+    uint32_t change_pct;
+};
+typedef struct vcpu_register_vdfs_notify vcpu_register_vdfs_notify_t;
+DEFINE_XEN_GUEST_HANDLE(vcpu_register_vdfs_notify_t);
+
+/*
+ * Return the VCPU's runstate together with how much of it was lost to its
+ * own VDFS target rather than to other VCPUs: time the cap held the VCPU
+ * back is counted under RUNSTATE_offline in @time and @share, and again in
+ * @throttled and @throttled_share. Time RUNSTATE_runnable is then down to
+ * contention for the physical CPUs alone.
+ * The layout is the same for 32- and 64-bit guests.
+ */
+#define VCPUOP_get_vdfs_runstate 20 /* arg == vcpu_vdfs_runstate_t */
+struct vcpu_vdfs_runstate {
+    uint64_t timestamp;
+    uint64_t time[4];        /* as vcpu_runstate_info.time */
+    uint64_t throttled;      /* ns */
+    /* Decayed shares, parts per VCPU_VDFS_RATIO_ONE. */
+    uint32_t share[4];
+    uint32_t throttled_share;
+    uint32_t available_khz;  /* as vcpu_vdfs_info.available_khz */
+};
+typedef struct vcpu_vdfs_runstate vcpu_vdfs_runstate_t;
+DEFINE_XEN_GUEST_HANDLE(vcpu_vdfs_runstate_t);
+
+/*
+ * Percentiles of how long the VCPU, or all of the caller's VCPUs together,
+ * waited to run each time they became runnable, since they were created.
+ * Latencies are the upper bounds of log-scale buckets at most 25% wide.
+ * The layout is the same for 32- and 64-bit guests.
+ */
+#define VCPUOP_get_wait_latency 21 /* arg == vcpu_wait_latency_t */
+#define VCPU_WAIT_vcpu   0
+#define VCPU_WAIT_domain 1
+struct vcpu_wait_latency {
+    /* IN */
+    uint32_t scope;          /* VCPU_WAIT_* */
+    uint32_t pad;
+    /* OUT */
+    uint64_t count;          /* waits on record */
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+};
+typedef struct vcpu_wait_latency vcpu_wait_latency_t;
+DEFINE_XEN_GUEST_HANDLE(vcpu_wait_latency_t);
+
+/*
+ * Burstable targets. Running time that a domain's VCPUs are allowed by
+ * their VCPUOP_set_target_freq targets but leave unused accrues as credit,
+ * up to @credit_max_ns, and the VCPUs spend it to run faster than their
+ * targets, up to @burst_pct of full speed, while it lasts.
+ * VCPU_VDFS_BURST_get returns a domain's settings and current balance;
+ * VCPU_VDFS_BURST_set, reserved to the control domain, changes the
+ * settings. @credit_max_ns of 0 (the default) turns bursting off.
+ * The @vcpuid argument is ignored.
+ */
+#define VCPUOP_vdfs_burst 22 /* arg == vcpu_vdfs_burst_t */
+#define VCPU_VDFS_BURST_get 0
+#define VCPU_VDFS_BURST_set 1
+struct vcpu_vdfs_burst {
+    /* IN */
+    uint32_t cmd;            /* VCPU_VDFS_BURST_* */
+    uint32_t domid;          /* domid or DOMID_SELF */
+    /* IN for set, OUT for get */
+    uint64_t credit_max_ns;
+    uint32_t burst_pct;
+    uint32_t pad;
+    /* OUT */
+    uint64_t credit_ns;
+};
+typedef struct vcpu_vdfs_burst vcpu_vdfs_burst_t;
+DEFINE_XEN_GUEST_HANDLE(vcpu_vdfs_burst_t);
+
 #endif /* __XEN_PUBLIC_VCPU_H__ */
 
 /*
@@ -19,6 +19,7 @@
 #include <xen/perfc.h>
 #include <asm/atomic.h>
 #include <xen/wait.h>
+#include <xen/vdfs.h>
 #include <public/xen.h>
 #include <public/domctl.h>
 #include <public/sysctl.h>
@@ -111,13 +112,23 @@ struct vcpu
 
     struct timer     poll_timer;    /* timeout for SCHEDOP_poll */
 
+    /* Frequency target (vcpu_set_target()), under the schedule lock. */
+    struct vdfs_cap  cap;
+    struct timer     cap_timer;
+    /* Rate-limited target requests, under the schedule lock. */
+    bool_t           target_pending;
+    uint32_t         target_next;
+    s_time_t         target_applied;
+    struct timer     target_timer;
+    /* Share of vdfs_cpu committed to this VCPU for placement. */
+    unsigned int     vdfs_cpu;
+    unsigned int     vdfs_commit;
+
     void            *sched_priv;    /* scheduler-specific data */
 
     struct vcpu_runstate_info runstate;
-    /*Modified by Sawyer
-     *header for average allocation
-     */
-    struct vcpu_runstate_info avg_runstate;
+    unsigned int     runstate_seq;  /* odd while runstate is being updated */
+    struct vcpu_vdfs *vdfs;
 #ifndef CONFIG_COMPAT
 # define runstate_guest(v) ((v)->runstate_guest)
     XEN_GUEST_HANDLE(vcpu_runstate_info_t) runstate_guest; /* guest address */
@@ -199,6 +210,17 @@ struct vcpu
     /* Guest-specified relocation of vcpu_info. */
     unsigned long vcpu_info_mfn;
 
+    /* Guest-registered effective-frequency area (VCPUOP_register_vdfs_...). */
+    struct vcpu_vdfs_info *vdfs_info;
+    unsigned long vdfs_info_mfn;
+
+    /* VCPUOP_register_vdfs_notify thresholds, under the schedule lock. */
+    unsigned int     vdfs_notify_port;      /* 0: none */
+    uint32_t         vdfs_notify_below_khz;
+    uint32_t         vdfs_notify_change;    /* per VCPU_VDFS_RATIO_ONE */
+    uint32_t         vdfs_notify_khz;       /* as of the last notification */
+    struct tasklet   vdfs_notify_tasklet;
+
     struct arch_vcpu arch;
 };
 
@@ -327,6 +349,14 @@ struct domain
      * raising DOM_EXC */
     int              suspend_evtchn;
 
+    /* VCPUOP_vdfs_burst credit, charged by the VCPUs' cap timers. */
+    spinlock_t       vdfs_credit_lock;
+    struct vdfs_credit vdfs_credit;
+
+    /* VCPUOP_set_target_freq requests, and those merged into later ones. */
+    atomic_t         vdfs_target_requests;
+    atomic_t         vdfs_target_merged;
+
     atomic_t         pause_count;
 
     unsigned long    vm_assist;
@@ -554,6 +584,7 @@ void sched_destroy_domain(struct domain *d);
 int sched_move_domain(struct domain *d, struct cpupool *c);
 long sched_adjust(struct domain *, struct xen_domctl_scheduler_op *);
 long sched_adjust_global(struct xen_sysctl_scheduler_op *);
+int  vcpu_set_target(struct vcpu *v, unsigned int target);
 void sched_set_node_affinity(struct domain *, nodemask_t *);
 int  sched_id(void);
 void sched_tick_suspend(void);
@@ -678,6 +709,9 @@ static inline struct domain *next_domain_in_cpupool(
  /* VCPU is being reset. */
 #define _VPF_in_reset        7
 #define VPF_in_reset         (1UL<<_VPF_in_reset)
+ /* VCPU has overrun its cap (vcpu_set_target()) for this period. */
+#define _VPF_capped          8
+#define VPF_capped           (1UL<<_VPF_capped)
 
 static inline int vcpu_runnable(struct vcpu *v)
 {
@@ -711,6 +745,19 @@ void restore_vcpu_affinity(struct domain *d);
 void vcpu_runstate_get(struct vcpu *v, struct vcpu_runstate_info *runstate);
 uint64_t get_cpu_idle_time(unsigned int cpu);
 
+uint32_t vcpu_max_khz(struct vcpu *v);
+uint32_t vcpu_dynamic_freq(struct vcpu *v, uint32_t *ratio);
+void vcpu_vdfs_runstate_get(struct vcpu *v, struct vcpu_vdfs_runstate *rs);
+void vcpu_vdfs_info_get(struct vcpu *v, struct vcpu_vdfs_info *info);
+int vcpu_wait_latency_get(struct vcpu *v, struct vcpu_wait_latency *lat);
+long vdfs_burst_op(struct vcpu_vdfs_burst *op);
+void vcpu_dynamic_freq_get(struct vcpu *v, s_time_t now,
+                           struct vcpu_dynamic_freq *freq);
+void vcpu_vdfs_update(struct vcpu *v);
+int vcpu_vdfs_notify_set(struct vcpu *v,
+                         const struct vcpu_register_vdfs_notify *notify);
+long vdfs_aggregate_get(struct vcpu_dynamic_freq_aggregate *agg);
+
 /*
  * Used by idle loop to decide whether there is work to do:
  *  (1) Run softirqs; or (2) Play dead; or (3) Run tasklets.
@@ -0,0 +1,759 @@
+/******************************************************************************
+ * vdfs.h
+ *
+ * VDFS (virtual dynamic frequency scaling) accounting and cap control.
+ *
+ * Everything here works on plain structures passed in by the caller: there
+ * are no locks, no reference to struct vcpu and no dependency beyond the
+ * fixed-point helpers, the barriers and atomics, and the runstate layout of
+ * public/vcpu.h. The scheduler's VDFS logic can therefore be compiled and
+ * driven on its own: tools/tests/vdfs replays runstate traces through it,
+ * and times its context switch path, in userspace. The glue that applies
+ * it to VCPUs and domains, under their locks, lives in common/schedule.c.
+ */
+
+#ifndef __XEN_VDFS_H__
+#define __XEN_VDFS_H__
+
+#include <xen/cache.h>
+#include <xen/string.h>
+#include <xen/vdfs_fixed.h>
+#include <asm/atomic.h>
+#include <asm/processor.h>
+#include <asm/system.h>
+#include <public/vcpu.h>
+
+/* Runstate indices, as RUNSTATE_* in public/vcpu.h. */
+#define VDFS_NR_STATES   4
+#define VDFS_RUNNING     0
+#define VDFS_RUNNABLE    1
+
+/*
+ * Decayed runstate averages. Time spent in a state counts half as much
+ * @halflife ns later, and the averages of a VCPU sum to @window in steady
+ * state.
+ */
+struct vdfs_decay {
+    uint64_t halflife;
+    uint64_t window;    /* halflife / ln(2) */
+};
+
+static inline void vdfs_decay_init(struct vdfs_decay *dc, uint64_t halflife)
+{
+    dc->halflife = halflife;
+    dc->window = vdfs_muldiv64(halflife, 1442695, 1000000);
+}
+
+/*
+ * 2^(-@delta / halflife) in 32.32 fixed point: whole half-lives are a
+ * shift, the remainder is interpolated between 1/32 half-life table steps.
+ */
+static inline uint64_t vdfs_decay_factor(const struct vdfs_decay *dc,
+                                         int64_t delta)
+{
+    /* 2^32 * 2^(-i/32) */
+    static const uint64_t frac[33] = {
+        0x100000000, 0x0fa83b2db, 0x0f5257d15, 0x0efe4b99c,
+        0x0eac0c6e8, 0x0e5b906e7, 0x0e0ccdeec, 0x0dbfbb798,
+        0x0d744fccb, 0x0d2a81d92, 0x0ce248c15, 0x0c9b9bd86,
+        0x0c5672a11, 0x0c12c4cca, 0x0bd08a39f, 0x0b8fbaf47,
+        0x0b504f334, 0x0b123f582, 0x0ad583eea, 0x0a9a15ab5,
+        0x0a5fed6aa, 0x0a2704303, 0x09ef53261, 0x09b8d39ba,
+        0x09837f052, 0x094f4efa9, 0x091c3d374, 0x08ea4398b,
+        0x08b95c1e4, 0x088980e81, 0x085aac368, 0x082cd8699,
+        0x080000000,
+    };
+    uint64_t periods, rem, step, factor;
+
+    if ( delta <= 0 )
+        return frac[0];
+
+    periods = delta / dc->halflife;
+    if ( periods >= 32 )
+        return 0;
+
+    rem = (delta - periods * dc->halflife) * 32;
+    step = rem / dc->halflife;
+    rem -= step * dc->halflife;
+
+    factor = frac[step] -
+             ((frac[step] - frac[step + 1]) * rem) / dc->halflife;
+
+    return factor >> periods;
+}
+
+/* Decayed weight of an interval whose end is @factor of a window ago. */
+static inline uint64_t vdfs_gain(const struct vdfs_decay *dc, uint64_t factor)
+{
+    return dc->window - vdfs_mul_q32(dc->window, factor);
+}
+
+/*
+ * Fold @delta ns spent in @state into the decayed averages @time[]: all of
+ * the history decays by 2^(-delta / half-life), and @state gains the
+ * decayed weight of the interval itself. The cost is the same however long
+ * the interval was, and the averages weigh time rather than transitions.
+ */
+static inline void vdfs_fold(const struct vdfs_decay *dc,
+                             uint64_t time[VDFS_NR_STATES],
+                             int state, int64_t delta)
+{
+    uint64_t factor = vdfs_decay_factor(dc, delta);
+    int i;
+
+    for ( i = 0; i < VDFS_NR_STATES; i++ )
+        time[i] = vdfs_mul_q32(time[i], factor);
+
+    time[state] += vdfs_gain(dc, factor);
+}
+
+/*
+ * Catch the averages @avg[] up from raw runstate counters, which is all
+ * the context switch path records. Over the first @mixed ns the VCPU spent
+ * @raw[i] ns in each state, in an order that is no longer known; that
+ * stretch is folded as if the states had been evenly interleaved, which is
+ * accurate as long as @mixed is small against the half-life. It then spent
+ * the last @stint ns in @cur, which is folded exactly.
+ */
+static inline void vdfs_fold_raw(const struct vdfs_decay *dc,
+                                 uint64_t avg[VDFS_NR_STATES],
+                                 const uint64_t raw[VDFS_NR_STATES],
+                                 int64_t mixed, int cur, int64_t stint)
+{
+    uint64_t factor, g;
+    int i;
+
+    if ( mixed > 0 )
+    {
+        factor = vdfs_decay_factor(dc, mixed);
+        g = vdfs_gain(dc, factor);
+        for ( i = 0; i < VDFS_NR_STATES; i++ )
+            avg[i] = vdfs_mul_q32(avg[i], factor) +
+                     vdfs_scale_ratio(g, vdfs_ratio(raw[i], mixed));
+    }
+
+    if ( stint > 0 )
+        vdfs_fold(dc, avg, cur, stint);
+}
+
+/*
+ * Fold into the single decayed average @avg an @interval ns stretch of
+ * which @part ns counted towards it, e.g. time a VCPU spent throttled.
+ */
+static inline uint64_t vdfs_fold_part(const struct vdfs_decay *dc,
+                                      uint64_t avg, uint64_t part,
+                                      int64_t interval)
+{
+    uint64_t factor;
+
+    if ( interval <= 0 )
+        return avg;
+
+    factor = vdfs_decay_factor(dc, interval);
+
+    return vdfs_mul_q32(avg, factor) +
+           vdfs_scale_ratio(vdfs_gain(dc, factor), vdfs_ratio(part, interval));
+}
+
+/*
+ * Split @time[] into per-state shares of VDFS_RATIO_ONE. Returns 0,
+ * leaving @share[] zeroed, if there is no time on record.
+ */
+static inline int vdfs_shares(const uint64_t time[VDFS_NR_STATES],
+                              uint32_t share[VDFS_NR_STATES])
+{
+    uint64_t total = 0;
+    int i;
+
+    for ( i = 0; i < VDFS_NR_STATES; i++ )
+        total += time[i];
+
+    for ( i = 0; i < VDFS_NR_STATES; i++ )
+        share[i] = vdfs_ratio(time[i], total);
+
+    return total != 0;
+}
+
+/*
+ * Split @time[] into per-state shares and return @max_khz scaled by the
+ * running share. Without any running time on record the result is
+ * @max_khz.
+ */
+static inline uint32_t vdfs_effective_khz(uint32_t max_khz,
+                                          const uint64_t time[VDFS_NR_STATES],
+                                          uint32_t share[VDFS_NR_STATES])
+{
+    vdfs_shares(time, share);
+
+    if ( share[VDFS_RUNNING] == 0 )
+        return max_khz;
+
+    return vdfs_scale_ratio(max_khz, share[VDFS_RUNNING]);
+}
+
+/*
+ * Whether an effective frequency that moved from @last to @khz since the
+ * last notification warrants another: it fell below @below, or it changed
+ * by more than @change parts per VDFS_RATIO_ONE of @last. Zero thresholds
+ * never fire.
+ */
+static inline int vdfs_notify_due(uint32_t last, uint32_t khz,
+                                  uint32_t below, uint32_t change)
+{
+    uint32_t diff = (khz > last) ? khz - last : last - khz;
+
+    if ( below && (khz < below) && (last >= below) )
+        return 1;
+
+    return change && (diff > vdfs_scale_ratio(last, change));
+}
+
+/*
+ * How fast the VCPU would run if it had work: @max_khz scaled by the share
+ * of the time it wanted to run (@time[] running or runnable, or @throttled
+ * by its cap) that it did run. Without such time on record, @max_khz.
+ */
+static inline uint32_t vdfs_available_khz(uint32_t max_khz,
+                                          const uint64_t time[VDFS_NR_STATES],
+                                          uint64_t throttled)
+{
+    uint64_t wanted = time[VDFS_RUNNING] + time[VDFS_RUNNABLE] + throttled;
+
+    if ( wanted == 0 )
+        return max_khz;
+
+    return vdfs_scale_ratio(max_khz, vdfs_ratio(time[VDFS_RUNNING], wanted));
+}
+
+/*
+ * Log-bucketed latency histograms: each power of two of the latency in
+ * units of 2^VDFS_HIST_UNIT_SHIFT ns is split into 2^VDFS_HIST_SUB_BITS
+ * buckets, so a bucket is at most 25% wide, and everything from about 2
+ * seconds up lands in the last one.
+ */
+#define VDFS_HIST_UNIT_SHIFT  10
+#define VDFS_HIST_SUB_BITS    2
+#define VDFS_HIST_SUB         (1 << VDFS_HIST_SUB_BITS)
+#define VDFS_HIST_BUCKETS     80
+
+static inline unsigned int vdfs_hist_bucket(uint64_t ns)
+{
+    uint64_t units = ns >> VDFS_HIST_UNIT_SHIFT;
+    unsigned int msb, idx;
+
+    if ( units < VDFS_HIST_SUB )
+        return units;
+
+    msb = 63 - __builtin_clzll(units);
+    idx = (msb - VDFS_HIST_SUB_BITS + 1) * VDFS_HIST_SUB +
+          ((units >> (msb - VDFS_HIST_SUB_BITS)) & (VDFS_HIST_SUB - 1));
+
+    return idx < VDFS_HIST_BUCKETS ? idx : VDFS_HIST_BUCKETS - 1;
+}
+
+/* Lowest latency, in ns, that falls into bucket @idx. */
+static inline uint64_t vdfs_hist_floor(unsigned int idx)
+{
+    unsigned int shift;
+
+    if ( idx < VDFS_HIST_SUB )
+        return (uint64_t)idx << VDFS_HIST_UNIT_SHIFT;
+
+    shift = idx / VDFS_HIST_SUB - 1;
+
+    return (uint64_t)(VDFS_HIST_SUB + idx % VDFS_HIST_SUB) <<
+           (shift + VDFS_HIST_UNIT_SHIFT);
+}
+
+/*
+ * Upper bound, in ns, of the latency below which @ppm parts per million of
+ * the @total samples in @hist[] fall: the top of the bucket holding the
+ * sample at that rank. Returns 0 for an empty histogram.
+ */
+static inline uint64_t vdfs_hist_quantile(const uint64_t hist[VDFS_HIST_BUCKETS],
+                                          uint64_t total, uint32_t ppm)
+{
+    uint64_t rank, seen = 0;
+    unsigned int i;
+
+    if ( total == 0 )
+        return 0;
+
+    rank = vdfs_muldiv64(total, ppm, 1000000);
+    for ( i = 0; i < VDFS_HIST_BUCKETS - 1; i++ )
+    {
+        seen += hist[i];
+        if ( seen > rank )
+            break;
+    }
+
+    return vdfs_hist_floor(i + 1);
+}
+
+/*
+ * VDFS accounting state of a VCPU, allocated on cache lines of its own so
+ * that remote queries do not contend with the scheduler's use of struct
+ * vcpu. Folds and cap updates run under the VCPU's schedule lock and keep
+ * @seq odd while they update the rest, so that readers can take a
+ * consistent copy without that lock.
+ */
+struct vcpu_vdfs {
+    unsigned int     seq;
+    s_time_t         stamp;         /* avg is accounted up to here */
+    uint64_t         folded[VDFS_NR_STATES]; /* runstate.time[] in avg */
+    /* Time in each RUNSTATE_*, decayed with a vdfs_halflife_ms half-life. */
+    struct vcpu_avg_runstate_info avg;
+
+    /*
+     * Time parked by the VDFS cap (_VPF_capped), which the runstate files
+     * under RUNSTATE_offline. Written under the schedule lock, covered by
+     * @seq like the averages.
+     */
+    s_time_t         capped_since;  /* 0: not parked */
+    uint64_t         throttled;     /* in total, up to capped_since */
+    uint64_t         throttled_avg; /* decayed like avg, up to throttled_stamp */
+    uint64_t         throttled_folded;
+    s_time_t         throttled_stamp;
+
+    /*
+     * Runnable-to-running waits, written under the schedule lock on every
+     * switch in, so on cache lines of their own, away from what remote
+     * readers copy above. 64 bits wide, so that no bucket wraps in the life
+     * of the VCPU, and read without the lock.
+     */
+    uint64_t         wait_hist[VDFS_HIST_BUCKETS] __cacheline_aligned;
+} __cacheline_aligned;
+
+/* Start accounting a zeroed @vd from runstate counters that start at @now. */
+static inline void vdfs_init(struct vcpu_vdfs *vd, s_time_t now)
+{
+    vd->stamp = vd->throttled_stamp = now;
+}
+
+/*
+ * Catch the averages @time[], accounted up to @stamp and covering
+ * @folded[] of the raw counters, up to @now. The context switch path only
+ * keeps the raw counters in @rs, which cover everything up to
+ * rs->state_entry_time; the stint in the current state is folded exactly,
+ * and what came before it since @stamp as a mix.
+ */
+static inline void vdfs_catch_up(const struct vdfs_decay *dc,
+                                 const struct vcpu_runstate_info *rs,
+                                 const uint64_t folded[VDFS_NR_STATES],
+                                 s_time_t stamp, s_time_t now,
+                                 uint64_t time[VDFS_NR_STATES])
+{
+    uint64_t raw[VDFS_NR_STATES] = { 0 };
+    s_time_t entry = rs->state_entry_time, mixed = 0, stint;
+    int i;
+
+    if ( stamp < entry )
+    {
+        mixed = entry - stamp;
+        for ( i = 0; i < VDFS_NR_STATES; i++ )
+            raw[i] = rs->time[i] - folded[i];
+        stint = now - entry;
+    }
+    else
+        stint = now - stamp;
+
+    vdfs_fold_raw(dc, time, raw, mixed, rs->state, stint);
+}
+
+/* Whether @vd's averages are at least @interval old at @now. */
+static inline int vdfs_account_due(const struct vcpu_vdfs *vd, s_time_t now,
+                                   s_time_t interval)
+{
+    return (now - vd->stamp) >= interval;
+}
+
+/*
+ * Bring @vd's averages up to @now from the raw counters in @rs. Returns
+ * whether there was anything to fold. Writers must be serialised.
+ */
+static inline int vdfs_account(const struct vdfs_decay *dc,
+                               struct vcpu_vdfs *vd,
+                               const struct vcpu_runstate_info *rs,
+                               s_time_t now)
+{
+    int i;
+
+    if ( now <= vd->stamp )
+        return 0;
+
+    vd->seq++;
+    smp_wmb();
+
+    vdfs_catch_up(dc, rs, vd->folded, vd->stamp, now, vd->avg.time);
+
+    /* folded[] also counts the part of the stint folded so far. */
+    for ( i = 0; i < VDFS_NR_STATES; i++ )
+        vd->folded[i] = rs->time[i];
+    vd->folded[rs->state] += now - rs->state_entry_time;
+    vd->stamp = now;
+
+    smp_wmb();
+    vd->seq++;
+
+    return 1;
+}
+
+/* A consistent copy of the raw counters @rs, whose writers bump @seq. */
+static inline void vdfs_runstate_snapshot(const unsigned int *seq,
+                                          const struct vcpu_runstate_info *rs,
+                                          struct vcpu_runstate_info *copy)
+{
+    unsigned int start;
+
+    do {
+        while ( (start = read_atomic(seq)) & 1 )
+            cpu_relax();
+        smp_rmb();
+        memcpy(copy, rs, sizeof(*copy));
+        smp_rmb();
+    } while ( start != read_atomic(seq) );
+}
+
+/*
+ * Move the raw counters @rs, whose readers check @seq, to @new_state at
+ * @now. A move from runnable to running is also a wait, which goes into
+ * @vd's histogram unless @vd is NULL. O(1). Writers must be serialised.
+ */
+static inline void vdfs_runstate_change(struct vcpu_runstate_info *rs,
+                                        unsigned int *seq, int new_state,
+                                        s_time_t now, struct vcpu_vdfs *vd)
+{
+    int old_state = rs->state;
+    s_time_t delta;
+
+    (*seq)++;
+    smp_wmb();
+
+    delta = now - rs->state_entry_time;
+    if ( delta > 0 )
+    {
+        rs->time[rs->state] += delta;
+        rs->state_entry_time = now;
+    }
+
+    rs->state = new_state;
+
+    smp_wmb();
+    (*seq)++;
+
+    if ( (vd != NULL) && (old_state == VDFS_RUNNABLE) &&
+         (new_state == VDFS_RUNNING) )
+        vd->wait_hist[vdfs_hist_bucket(delta > 0 ? delta : 0)]++;
+}
+
+/*
+ * Decayed runstate times in @time[] as of @now, without the writers' lock:
+ * consistent copies of @vd's averages and of the raw counters @rs kept
+ * since, caught up privately unless @catch_up is zero. Readers therefore
+ * neither contend with the writers nor with each other.
+ */
+static inline void vdfs_read(const struct vdfs_decay *dc,
+                             const struct vcpu_vdfs *vd,
+                             const unsigned int *rs_seq,
+                             const struct vcpu_runstate_info *rs,
+                             s_time_t now, int catch_up,
+                             uint64_t time[VDFS_NR_STATES])
+{
+    struct vcpu_runstate_info copy;
+    uint64_t folded[VDFS_NR_STATES];
+    s_time_t stamp;
+    unsigned int seq;
+
+    /* The averages first: the raw counters must be at least as recent. */
+    do {
+        while ( (seq = read_atomic(&vd->seq)) & 1 )
+            cpu_relax();
+        smp_rmb();
+        memcpy(time, vd->avg.time, sizeof(vd->avg.time));
+        memcpy(folded, vd->folded, sizeof(folded));
+        stamp = vd->stamp;
+        smp_rmb();
+    } while ( seq != read_atomic(&vd->seq) );
+
+    if ( !catch_up || (now <= stamp) )
+        return;
+
+    vdfs_runstate_snapshot(rs_seq, rs, &copy);
+    vdfs_catch_up(dc, &copy, folded, stamp, now, time);
+}
+
+/* Running time on record in @rs by @now, including the current stint. */
+static inline s_time_t vdfs_running_time(const struct vcpu_runstate_info *rs,
+                                         s_time_t now)
+{
+    s_time_t running = rs->time[VDFS_RUNNING];
+
+    if ( rs->state == VDFS_RUNNING )
+        running += now - rs->state_entry_time;
+
+    return running;
+}
+
+/*
+ * Account the time parked by the cap up to @now and fold it into @vd's
+ * decayed average; @parked says whether the VCPU stays parked from now on.
+ * Writers must be serialised with each other and with vdfs_account().
+ */
+static inline void vdfs_throttle(const struct vdfs_decay *dc,
+                                 struct vcpu_vdfs *vd, s_time_t now,
+                                 int parked)
+{
+    vd->seq++;
+    smp_wmb();
+
+    if ( vd->capped_since )
+        vd->throttled += now - vd->capped_since;
+    vd->capped_since = parked ? now : 0;
+
+    vd->throttled_avg = vdfs_fold_part(dc, vd->throttled_avg,
+                                       vd->throttled - vd->throttled_folded,
+                                       now - vd->throttled_stamp);
+    vd->throttled_folded = vd->throttled;
+    vd->throttled_stamp = now;
+
+    smp_wmb();
+    vd->seq++;
+}
+
+/*
+ * Decayed throttled time of @vd as of @now, and in @throttled its total,
+ * from a consistent copy taken without the writers' lock.
+ */
+static inline uint64_t vdfs_throttled(const struct vdfs_decay *dc,
+                                      const struct vcpu_vdfs *vd,
+                                      s_time_t now, uint64_t *throttled)
+{
+    s_time_t capped_since, stamp;
+    uint64_t avg, folded;
+    unsigned int seq;
+
+    do {
+        while ( (seq = read_atomic(&vd->seq)) & 1 )
+            cpu_relax();
+        smp_rmb();
+        capped_since = vd->capped_since;
+        *throttled = vd->throttled;
+        avg = vd->throttled_avg;
+        folded = vd->throttled_folded;
+        stamp = vd->throttled_stamp;
+        smp_rmb();
+    } while ( seq != read_atomic(&vd->seq) );
+
+    /* The VCPU may have been parked after @now was taken. */
+    if ( capped_since && (now > capped_since) )
+        *throttled += now - capped_since;
+
+    return vdfs_fold_part(dc, avg, *throttled - folded, now - stamp);
+}
+
+/*
+ * Add @vd's waits to @hist[], without the writers' lock: each bucket is
+ * read whole, though the buckets may be a few switches apart.
+ */
+static inline void vdfs_wait_hist_add(const struct vcpu_vdfs *vd,
+                                      uint64_t hist[VDFS_HIST_BUCKETS])
+{
+    unsigned int i;
+
+    for ( i = 0; i < VDFS_HIST_BUCKETS; i++ )
+        hist[i] += read_atomic(&vd->wait_hist[i]);
+}
+
+/*
+ * Share of a CPU, in parts per VDFS_COMMIT_ONE, that a VCPU commits to the
+ * CPU it is placed on: its frequency @target, or the whole CPU without one.
+ */
+#define VDFS_COMMIT_ONE  10000
+
+static inline unsigned int vdfs_demand(uint32_t target)
+{
+    if ( target == 0 )
+        return VDFS_COMMIT_ONE;
+
+    return target / (VDFS_RATIO_ONE / VDFS_COMMIT_ONE);
+}
+
+/*
+ * Move a commitment of @*share on @*cpu to @demand on @new_cpu, in the
+ * per-CPU totals that @committed() returns. The context switch path does
+ * this for every VCPU it switches in, so the usual case is a comparison.
+ */
+static inline void vdfs_commit(unsigned int *cpu, unsigned int *share,
+                               unsigned int new_cpu, unsigned int demand,
+                               atomic_t *(*committed)(unsigned int cpu))
+{
+    if ( likely((*cpu == new_cpu) && (*share == demand)) )
+        return;
+
+    atomic_sub(*share, committed(*cpu));
+    atomic_add(demand, committed(new_cpu));
+    *cpu = new_cpu;
+    *share = demand;
+}
+
+/*
+ * Per-VCPU frequency target and the cap steering towards it, both in parts
+ * per VDFS_RATIO_ONE. The cap is enforced as a running-time budget per
+ * period.
+ */
+struct vdfs_cap {
+    uint32_t target;    /* 0: no target */
+    uint32_t cap;
+    int64_t  budget;    /* running time left this period */
+    int64_t  charged;   /* running time already charged */
+    int      bursting;  /* ran on burst credit last period */
+};
+
+/*
+ * Integral control of the cap: each period moves it by 1/2^VDFS_CAP_SHIFT
+ * of the gap between the target and the measured running share.
+ */
+#define VDFS_CAP_SHIFT   2
+#define VDFS_CAP_MIN     (VDFS_RATIO_ONE / 100)
+
+/* Start enforcing @target, with @running ns of running time so far. */
+static inline void vdfs_cap_start(struct vdfs_cap *c, uint32_t target,
+                                  int64_t period, int64_t running)
+{
+    c->target = c->cap = target;
+    c->budget = vdfs_scale_ratio(period, c->cap);
+    c->charged = running;
+}
+
+/*
+ * Make @target the target, 0 to remove it. A new target starts the cap
+ * afresh; a changed one takes over at its own value.
+ */
+static inline void vdfs_cap_set(struct vdfs_cap *c, uint32_t target,
+                                int64_t period, int64_t running)
+{
+    if ( c->target == 0 )
+        vdfs_cap_start(c, target, period, running);
+    else
+        c->target = c->cap = target;
+}
+
+/*
+ * Steer the cap given the @measured running share and whether the cap
+ * held the VCPU back (@capped) during the last period.
+ */
+static inline void vdfs_cap_steer(struct vdfs_cap *c, uint32_t measured,
+                                  int capped)
+{
+    int64_t cap = c->cap;
+
+    cap += ((int64_t)c->target - measured) >> VDFS_CAP_SHIFT;
+
+    /*
+     * Raising the cap only helps if the cap is what held the VCPU back;
+     * otherwise it is idle or the host is contended, and winding the cap
+     * up would let it overshoot once that changes.
+     */
+    if ( (cap > c->cap) && !capped )
+        return;
+
+    if ( cap < VDFS_CAP_MIN )
+        cap = VDFS_CAP_MIN;
+    else if ( cap > VDFS_RATIO_ONE )
+        cap = VDFS_RATIO_ONE;
+
+    c->cap = cap;
+}
+
+/*
+ * Burst credit shared by the VCPUs of a domain: running time their caps
+ * allowed but they did not use, banked up to @max ns, which lets them run
+ * above their caps, up to @burst, while it lasts.
+ */
+struct vdfs_credit {
+    int64_t  balance;
+    int64_t  max;       /* 0: no bursting */
+    uint32_t burst;     /* speed ceiling while bursting */
+};
+
+/*
+ * Charge the running time up to @running against the budget and refill it
+ * with one @period's share. Returns non-zero if the VCPU has overrun and
+ * must not run until a later period has paid the overrun off.
+ *
+ * Unused share beyond one period's worth goes to @credit; an overrun is
+ * paid from @credit as far as it reaches, but never for more than running
+ * at @credit->burst over the period. @c->bursting tells whether it was.
+ */
+static inline int vdfs_cap_charge(struct vdfs_cap *c, int64_t period,
+                                  int64_t running, struct vdfs_credit *credit)
+{
+    int64_t share = vdfs_scale_ratio(period, c->cap);
+    int64_t draw;
+
+    c->budget += share - (running - c->charged);
+    c->charged = running;
+    c->bursting = 0;
+
+    if ( c->budget > share )
+    {
+        credit->balance += c->budget - share;
+        if ( credit->balance > credit->max )
+            credit->balance = credit->max;
+        c->budget = share;
+    }
+    else if ( (c->budget < 0) && (credit->balance > 0) )
+    {
+        draw = vdfs_scale_ratio(period, credit->burst) - share;
+        if ( draw > -c->budget )
+            draw = -c->budget;
+        if ( draw > credit->balance )
+            draw = credit->balance;
+        if ( draw > 0 )
+        {
+            c->budget += draw;
+            credit->balance -= draw;
+            c->bursting = 1;
+        }
+    }
+
+    return c->budget < 0;
+}
+
+/*
+ * End a cap @period for a VCPU that ran @share of the recent time at
+ * @speed (both parts per VDFS_RATIO_ONE) of its physical CPU's full speed,
+ * with @running ns of running time so far; @capped says whether the cap
+ * held it back. The cap is steered on the share measured at full speed,
+ * returned in @measured, unless the VCPU ran on burst credit, and the
+ * period is charged. The caller holds @credit's lock. Returns as
+ * vdfs_cap_charge().
+ */
+static inline int vdfs_cap_period(struct vdfs_cap *c, int64_t period,
+                                  uint32_t share, uint32_t speed, int capped,
+                                  int64_t running, struct vdfs_credit *credit,
+                                  uint32_t *measured)
+{
+    *measured = vdfs_scale_ratio(share, speed);
+
+    /*
+     * The measured share includes any burst, which the cap must not be
+     * steered down to make up for.
+     */
+    if ( !c->bursting )
+        vdfs_cap_steer(c, *measured, capped);
+
+    return vdfs_cap_charge(c, period, running, credit);
+}
+
+#endif /* __XEN_VDFS_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
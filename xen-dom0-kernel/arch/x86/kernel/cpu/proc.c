@@ -3,10 +3,180 @@
 #include <linux/string.h>
 #include <linux/seq_file.h>
 #include <linux/cpufreq.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/syscore_ops.h>
 
+#include <asm/pvclock.h>
 #include <asm/xen/hypercall.h>
+#include <asm/xen/page.h>
 
 #include <xen/interface/vcpu.h>
+#include <xen/vdfs_fixed.h>
+#include <xen/xen.h>
+#include <xen/xen-ops.h>
+
+/*
+ * Xen publishes each vCPU's effective frequency in this per-cpu area once
+ * it is registered, so reading /proc/cpuinfo does not have to trap into
+ * the hypervisor once per CPU while the vCPUs are busy.
+ */
+static DEFINE_PER_CPU_ALIGNED(struct vcpu_vdfs_info, xen_vdfs_info);
+/*
+ * 0: not registered yet, 1: registered, -1: unavailable, 2: registered
+ * before a resume, on a host that may not know of it.
+ */
+static DEFINE_PER_CPU(int, xen_vdfs_state);
+static DEFINE_MUTEX(xen_vdfs_mutex);
+
+/*
+ * Xen stops refreshing the area while the vCPU is blocked or waiting to
+ * run, so figures older than this many refresh intervals (a half-life of
+ * the averages, with Xen's defaults) are asked for with the hypercall
+ * instead, which is always current.
+ */
+#define XEN_VDFS_STALE_REFRESHES	8
+
+/* Xen system time, as the area's timestamp. */
+static u64 xen_vdfs_now(void)
+{
+	u64 now;
+
+	preempt_disable();
+	now = pvclock_clocksource_read(&__this_cpu_read(xen_vcpu)->time);
+	preempt_enable();
+
+	return now;
+}
+
+static int xen_vdfs_register(unsigned int cpu)
+{
+	struct vcpu_vdfs_info *info = &per_cpu(xen_vdfs_info, cpu);
+	struct vcpu_register_vdfs_memory_area area;
+	int state = ACCESS_ONCE(per_cpu(xen_vdfs_state, cpu));
+
+	/* Settled until a resume, so only the first readers serialise. */
+	if (state == 1 || state == -1)
+		return state;
+
+	mutex_lock(&xen_vdfs_mutex);
+	state = per_cpu(xen_vdfs_state, cpu);
+	if (state == 0 || state == 2) {
+		/* Nothing from the last host is to be trusted. */
+		if (state == 2)
+			memset(info, 0, sizeof(*info));
+		area.mfn = arbitrary_virt_to_mfn(info);
+		area.offset = offset_in_page(info);
+		area.rsvd = 0;
+		/*
+		 * After a cancelled suspend Xen still has the area and
+		 * refuses it again, which is as good as success.
+		 */
+		if (!HYPERVISOR_vcpu_op(VCPUOP_register_vdfs_memory_area,
+					cpu, &area) || state == 2)
+			state = 1;
+		else
+			state = -1;
+		ACCESS_ONCE(per_cpu(xen_vdfs_state, cpu)) = state;
+	}
+	mutex_unlock(&xen_vdfs_mutex);
+
+	return state;
+}
+
+/*
+ * A restored guest may be on a host that has never heard of its areas,
+ * with a system time that no longer matches their timestamps: register
+ * them again on first use, as xen_vcpu_restore() does for vcpu_info.
+ */
+static void xen_vdfs_resume(void)
+{
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu)
+		if (per_cpu(xen_vdfs_state, cpu) == 1)
+			per_cpu(xen_vdfs_state, cpu) = 2;
+}
+
+static struct syscore_ops xen_vdfs_syscore_ops = {
+	.resume	= xen_vdfs_resume,
+};
+
+static int __init xen_vdfs_init(void)
+{
+	if (xen_domain())
+		register_syscore_ops(&xen_vdfs_syscore_ops);
+	return 0;
+}
+device_initcall(xen_vdfs_init);
+
+/*
+ * Get the frequency the vCPU ran at (@effective_khz), the one it would get
+ * if it had work (@available_khz) and its maximum (@max_khz), leaving them
+ * alone if the hypervisor does not say.
+ */
+static void xen_vdfs_read(unsigned int cpu, uint32_t *effective_khz,
+			 uint32_t *available_khz, uint32_t *max_khz)
+{
+	struct vcpu_vdfs_info *info = &per_cpu(xen_vdfs_info, cpu);
+	struct vcpu_vdfs_info snap;
+	uint32_t version, refresh_us;
+	u64 timestamp;
+	s64 age;
+	int ret;
+
+	if (xen_vdfs_register(cpu) > 0) {
+		do {
+			version = ACCESS_ONCE(info->version);
+			rmb();
+			*effective_khz = info->effective_khz;
+			*available_khz = info->available_khz;
+			*max_khz = info->max_khz;
+			refresh_us = info->refresh_us;
+			timestamp = info->timestamp;
+			rmb();
+		} while ((version & 1) ||
+			 version != ACCESS_ONCE(info->version));
+
+		/*
+		 * Ask the hypervisor if nothing has been published yet or it
+		 * has gone stale; a zero refresh_us means an update whenever
+		 * the vCPU is scheduled. A timestamp ahead of our clock is
+		 * from another host's, before a restore, so stale as well.
+		 */
+		age = xen_vdfs_now() - timestamp;
+		if (version && age >= 0 &&
+		    (!refresh_us || age <= (s64)refresh_us * NSEC_PER_USEC *
+					   XEN_VDFS_STALE_REFRESHES))
+			return;
+	}
+
+	/*
+	 * Hypervisors that predate the snapshot leave it alone and only
+	 * return the effective frequency, which all of them do.
+	 */
+	memset(&snap, 0, sizeof(snap));
+	ret = HYPERVISOR_vcpu_op(VCPUOP_get_dynamic_freq, cpu, &snap);
+	if (ret < 0)
+		return;
+
+	*effective_khz = ret;
+	if (snap.available_khz)
+		*available_khz = snap.available_khz;
+	if (snap.max_khz)
+		*max_khz = snap.max_khz;
+}
+
+/*
+ * The xen-vdfs cpufreq driver reports the target it asked Xen for as the
+ * current frequency, not the speed the vCPU can reach.
+ */
+static bool xen_vdfs_owns_cpufreq(void)
+{
+	const char *driver = cpufreq_get_current_driver();
+
+	return driver && !strcmp(driver, "xen-vdfs");
+}
 
 /*
  *	Get CPU information for use by the procfs.
@@ -60,8 +230,8 @@ static int show_cpuinfo(struct seq_file *m, void *v)
 	struct cpuinfo_x86 *c = v;
 	unsigned int cpu;
 	int i;
-        int ratio = 0;
-        unsigned int runningFreq = 0;
+        unsigned int ratio = 0;
+        uint32_t runningFreq = 0, availableFreq = 0;
 
 	cpu = c->cpu_index;
 	seq_printf(m, "processor\t: %u\n"
@@ -83,20 +253,23 @@ static int show_cpuinfo(struct seq_file *m, void *v)
 		seq_printf(m, "microcode\t: 0x%x\n", c->microcode);
 
 	if (cpu_has(c, X86_FEATURE_TSC)) {
-		unsigned int freq = cpufreq_quick_get(cpu);
-               
-                if (!freq)
-                        freq = cpu_khz;
- 
+		unsigned int freq = 0;
+		uint32_t maxFreq = 0;
+
+		if (!xen_vdfs_owns_cpufreq())
+			freq = cpufreq_quick_get(cpu);
 		
 		/*Modified by Sawyer
  		 *
  		 *The code now prents the system maximum, the effective maximum,
 		 *and the ratio between the two
  		 */ 
-		runningFreq = HYPERVISOR_vcpu_op(VCPUOP_get_dynamic_freq,
-                           cpu, NULL);
-                ratio = (int)(((double)runningFreq / (double)freq) * 100.0);
+		xen_vdfs_read(cpu, &runningFreq, &availableFreq, &maxFreq);
+		if (!freq)
+			freq = maxFreq ? : cpu_khz;
+		/* In hundredths of a percent. */
+		if (freq)
+			ratio = vdfs_muldiv64(runningFreq, 10000, freq);
 
 		seq_printf(m, "Max cpu MHz\t: %u.%03u\n",
 			   freq / 1000, (freq % 1000));
@@ -104,8 +277,13 @@ static int show_cpuinfo(struct seq_file *m, void *v)
                 seq_printf(m, "Cpu MHz\t\t: %u.%03u\n",
                            runningFreq / 1000, (runningFreq % 1000));
 
-                seq_printf(m, "CPU Usage\t: %d%%\n",
-                           ratio);
+		/* Hypervisors that do not work it out leave it at 0. */
+		if (availableFreq)
+			seq_printf(m, "Available MHz\t: %u.%03u\n",
+				   availableFreq / 1000, availableFreq % 1000);
+
+		seq_printf(m, "CPU Usage\t: %u.%02u%%\n",
+			   ratio / 100, ratio % 100);
 
 	}
 
@@ -0,0 +1,179 @@
+/*
+ * xen-vdfs-cpufreq.c - cpufreq driver for Xen virtual dynamic frequency
+ * scaling (VDFS)
+ *
+ * Each vCPU is its own cpufreq policy. Setting its frequency asks Xen for a
+ * target share of the physical CPU speed (VCPUOP_set_target_freq), which
+ * Xen enforces by capping the vCPU; reading it back returns the effective
+ * frequency Xen measures for the vCPU (VCPUOP_get_dynamic_freq). Stock
+ * governors and the userspace interface can then drive VDFS per vCPU.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/cpufreq.h>
+#include <linux/slab.h>
+
+#include <asm/tsc.h>
+#include <asm/xen/hypervisor.h>
+#include <asm/xen/hypercall.h>
+
+#include <xen/xen.h>
+#include <xen/interface/vcpu.h>
+#include <xen/vdfs_fixed.h>
+
+/* Targets are whole percentages; offer steps of this many down to one. */
+#define XEN_VDFS_STEP_PCT	5
+#define XEN_VDFS_NR_STEPS	(100 / XEN_VDFS_STEP_PCT)
+
+/* Entry i asks for (i + 1) * XEN_VDFS_STEP_PCT percent of max_khz. */
+static struct cpufreq_frequency_table *xen_vdfs_table;
+static unsigned int xen_vdfs_max_khz;
+
+static unsigned int xen_vdfs_cpufreq_get(unsigned int cpu)
+{
+	int khz = HYPERVISOR_vcpu_op(VCPUOP_get_dynamic_freq, cpu, NULL);
+
+	return khz > 0 ? khz : 0;
+}
+
+static int xen_vdfs_cpufreq_verify(struct cpufreq_policy *policy)
+{
+	return cpufreq_frequency_table_verify(policy, xen_vdfs_table);
+}
+
+static int xen_vdfs_cpufreq_target(struct cpufreq_policy *policy,
+				   unsigned int target_freq,
+				   unsigned int relation)
+{
+	struct cpufreq_freqs freqs;
+	unsigned int index;
+	uint16_t pct;
+	int ret;
+
+	ret = cpufreq_frequency_table_target(policy, xen_vdfs_table,
+					     target_freq, relation, &index);
+	if (ret)
+		return ret;
+
+	freqs.old = policy->cur;
+	freqs.new = xen_vdfs_table[index].frequency;
+	if (freqs.old == freqs.new)
+		return 0;
+
+	/* 100% removes the target altogether. */
+	pct = (index + 1) * XEN_VDFS_STEP_PCT;
+
+	cpufreq_notify_transition(policy, &freqs, CPUFREQ_PRECHANGE);
+	ret = HYPERVISOR_vcpu_op(VCPUOP_set_target_freq, policy->cpu, &pct);
+	if (ret)
+		freqs.new = freqs.old;
+	cpufreq_notify_transition(policy, &freqs, CPUFREQ_POSTCHANGE);
+
+	return ret;
+}
+
+static int xen_vdfs_cpufreq_init(struct cpufreq_policy *policy)
+{
+	int ret;
+
+	ret = cpufreq_frequency_table_cpuinfo(policy, xen_vdfs_table);
+	if (ret)
+		return ret;
+
+	/*
+	 * The hypercall returns at once; Xen rate limits target changes and
+	 * converges on them over its cap periods on its own.
+	 */
+	policy->cpuinfo.transition_latency = 10 * NSEC_PER_USEC;
+	policy->cur = xen_vdfs_max_khz;
+	cpumask_set_cpu(policy->cpu, policy->cpus);
+	cpufreq_frequency_table_get_attr(xen_vdfs_table, policy->cpu);
+
+	return 0;
+}
+
+static int xen_vdfs_cpufreq_exit(struct cpufreq_policy *policy)
+{
+	uint16_t pct = 100;
+
+	cpufreq_frequency_table_put_attr(policy->cpu);
+	HYPERVISOR_vcpu_op(VCPUOP_set_target_freq, policy->cpu, &pct);
+
+	return 0;
+}
+
+static struct freq_attr *xen_vdfs_cpufreq_attr[] = {
+	&cpufreq_freq_attr_scaling_available_freqs,
+	NULL,
+};
+
+/*
+ * The TSC, and so loops_per_jiffy, runs at the same rate whatever share of
+ * the physical CPU the vCPU gets. This also keeps the core from treating
+ * the measured frequency returned by ->get as a missed transition.
+ */
+static struct cpufreq_driver xen_vdfs_cpufreq_driver = {
+	.name		= "xen-vdfs",
+	.flags		= CPUFREQ_CONST_LOOPS,
+	.init		= xen_vdfs_cpufreq_init,
+	.exit		= xen_vdfs_cpufreq_exit,
+	.verify		= xen_vdfs_cpufreq_verify,
+	.target		= xen_vdfs_cpufreq_target,
+	.get		= xen_vdfs_cpufreq_get,
+	.attr		= xen_vdfs_cpufreq_attr,
+	.owner		= THIS_MODULE,
+};
+
+static int __init xen_vdfs_cpufreq_register(void)
+{
+	unsigned int i;
+	int ret;
+
+	if (!xen_domain() || !tsc_khz)
+		return -ENODEV;
+
+	/* Hypervisors without VDFS fail the query. */
+	if (HYPERVISOR_vcpu_op(VCPUOP_get_dynamic_freq, 0, NULL) <= 0)
+		return -ENODEV;
+
+	xen_vdfs_table = kcalloc(XEN_VDFS_NR_STEPS + 1,
+				 sizeof(*xen_vdfs_table), GFP_KERNEL);
+	if (!xen_vdfs_table)
+		return -ENOMEM;
+
+	xen_vdfs_max_khz = tsc_khz;
+	for (i = 0; i < XEN_VDFS_NR_STEPS; i++)
+		xen_vdfs_table[i].frequency =
+			vdfs_muldiv64(xen_vdfs_max_khz,
+				      (i + 1) * XEN_VDFS_STEP_PCT, 100);
+	xen_vdfs_table[i].frequency = CPUFREQ_TABLE_END;
+
+	ret = cpufreq_register_driver(&xen_vdfs_cpufreq_driver);
+	if (ret) {
+		kfree(xen_vdfs_table);
+		return ret;
+	}
+
+	pr_info("per-vCPU targets up to %u kHz\n", xen_vdfs_max_khz);
+	return 0;
+}
+
+static void __exit xen_vdfs_cpufreq_unregister(void)
+{
+	cpufreq_unregister_driver(&xen_vdfs_cpufreq_driver);
+	kfree(xen_vdfs_table);
+}
+
+module_init(xen_vdfs_cpufreq_register);
+module_exit(xen_vdfs_cpufreq_unregister);
+
+MODULE_DESCRIPTION("cpufreq driver for Xen virtual dynamic frequency scaling");
+MODULE_LICENSE("GPL");
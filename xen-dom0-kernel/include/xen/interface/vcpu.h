@@ -179,4 +179,94 @@ DEFINE_GUEST_HANDLE_STRUCT(vcpu_register_vcpu_info);
 
 /* Send an NMI to the specified VCPU. @extra_arg == NULL. */
 #define VCPUOP_send_nmi             11
+
+/*
+ * Register a memory location in which Xen publishes the VCPU's effective
+ * frequency (see VCPUOP_get_dynamic_freq) so that it can be read without a
+ * hypercall. Versioned like vcpu_time_info: the version is odd while an
+ * update is in progress. The structure must not cross a page boundary.
+ * Xen does not refresh it while the vCPU stays blocked or waiting to run:
+ * once @timestamp is a few @refresh_us old, use VCPUOP_get_dynamic_freq.
+ */
+#define VCPUOP_register_vdfs_memory_area 16
+struct vcpu_vdfs_info {
+    uint32_t version;
+    uint32_t refresh_us;    /* Shortest interval between updates. */
+    uint64_t timestamp;     /* System time (ns) of the last update. */
+    uint32_t max_khz;       /* Speed of the underlying physical CPU. */
+    uint32_t effective_khz; /* max_khz scaled by the running share. */
+    uint32_t running_ratio; /* Running share, parts per VCPU_VDFS_RATIO_ONE. */
+    uint32_t available_khz; /* Speed the vCPU would get if it had work. */
+};
+#define VCPU_VDFS_RATIO_ONE 1000000000U
+
+struct vcpu_register_vdfs_memory_area {
+    uint64_t mfn;    /* mfn of page to place vcpu_vdfs_info */
+    uint32_t offset; /* offset within page */
+    uint32_t rsvd;   /* unused */
+};
+DEFINE_GUEST_HANDLE_STRUCT(vcpu_register_vdfs_memory_area);
+
+/*
+ * Have Xen signal @port (as EVTCHNOP_send would) when the VCPU's effective
+ * frequency drops below @below_khz or moves by more than @change_pct
+ * percent since the last notification. A zero @port stops notifications.
+ */
+#define VCPUOP_register_vdfs_notify 19
+struct vcpu_register_vdfs_notify {
+    uint32_t port;
+    uint32_t below_khz;
+    uint32_t change_pct;
+};
+DEFINE_GUEST_HANDLE_STRUCT(vcpu_register_vdfs_notify);
+
+/*
+ * The VCPU's runstate, with the time its own VDFS target held it back
+ * (also counted under RUNSTATE_offline) split out as @throttled.
+ */
+#define VCPUOP_get_vdfs_runstate 20
+struct vcpu_vdfs_runstate {
+    uint64_t timestamp;
+    uint64_t time[4];
+    uint64_t throttled;
+    uint32_t share[4];
+    uint32_t throttled_share;
+    uint32_t available_khz;
+};
+DEFINE_GUEST_HANDLE_STRUCT(vcpu_vdfs_runstate);
+
+/*
+ * Percentiles of the runnable-to-running waits of the vCPU, or of all of
+ * the domain's vCPUs.
+ */
+#define VCPUOP_get_wait_latency 21
+#define VCPU_WAIT_vcpu   0
+#define VCPU_WAIT_domain 1
+struct vcpu_wait_latency {
+    uint32_t scope;
+    uint32_t pad;
+    uint64_t count;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+};
+DEFINE_GUEST_HANDLE_STRUCT(vcpu_wait_latency);
+
+/*
+ * Burst credit: unused target time banked up to @credit_max_ns and spent
+ * to run above the target, up to @burst_pct, while it lasts.
+ */
+#define VCPUOP_vdfs_burst 22
+#define VCPU_VDFS_BURST_get 0
+#define VCPU_VDFS_BURST_set 1
+struct vcpu_vdfs_burst {
+    uint32_t cmd;
+    uint32_t domid;
+    uint64_t credit_max_ns;
+    uint32_t burst_pct;
+    uint32_t pad;
+    uint64_t credit_ns;
+};
+DEFINE_GUEST_HANDLE_STRUCT(vcpu_vdfs_burst);
 #endif /* __XEN_PUBLIC_VCPU_H__ */
@@ -0,0 +1,106 @@
+/*
+ * vdfs_fixed.h: integer arithmetic for VDFS effective-frequency reporting.
+ *
+ * Shared between the hypervisor (xen/include/xen/vdfs_fixed.h) and the
+ * dom0 kernel (include/xen/vdfs_fixed.h); keep the two copies identical.
+ * Everything here is exact (rounded down) and cannot overflow, and none of
+ * it needs floating point or 64-by-64-bit division.
+ */
+
+#ifndef __XEN_VDFS_FIXED_H__
+#define __XEN_VDFS_FIXED_H__
+
+#ifdef __XEN__
+#include <xen/types.h>
+#else
+#include <linux/types.h>
+#include <linux/math64.h>
+#endif
+
+/* Shares are expressed in parts per VDFS_RATIO_ONE (VCPU_VDFS_RATIO_ONE). */
+#define VDFS_RATIO_ONE	1000000000U
+
+/* @n / @d, with the remainder in @rem. */
+static inline uint64_t vdfs_div_rem(uint64_t n, uint32_t d, uint32_t *rem)
+{
+#ifdef __XEN__
+	*rem = n % d;
+	return n / d;
+#else
+	return div_u64_rem(n, d, rem);
+#endif
+}
+
+/*
+ * @a * @mul / @div, saturating at ~0ULL. The 96-bit product is held as
+ * hi:lo and divided in two 64-by-32-bit steps, which avoids the 128-bit
+ * division helpers neither kernel links against. @div must be non-zero.
+ */
+static inline uint64_t vdfs_muldiv64(uint64_t a, uint32_t mul, uint32_t div)
+{
+	uint64_t hi = (a >> 32) * mul, lo = (a & 0xffffffff) * mul, q_hi, q_lo;
+	uint32_t rem;
+
+	/* Cannot overflow: (2^32 - 1)^2 + (2^32 - 1) < 2^64. */
+	hi += lo >> 32;
+
+	q_hi = vdfs_div_rem(hi, div, &rem);
+	if (q_hi >> 32)
+		return ~0ULL;
+	q_lo = vdfs_div_rem(((uint64_t)rem << 32) | (lo & 0xffffffff),
+			    div, &rem);
+
+	return (q_hi << 32) + q_lo;
+}
+
+/* @a scaled by the Q32.32 fraction @frac, which must not exceed 1.0. */
+static inline uint64_t vdfs_mul_q32(uint64_t a, uint64_t frac)
+{
+#ifdef __SIZEOF_INT128__
+	return ((unsigned __int128)a * frac) >> 32;
+#else
+	return ((a >> 32) * frac) + (((a & 0xffffffff) * frac) >> 32);
+#endif
+}
+
+/* @part / @total in parts per VDFS_RATIO_ONE, clamped to 1.0; 0 if @total is. */
+static inline uint32_t vdfs_ratio(uint64_t part, uint64_t total)
+{
+	/* Dropping bits below the top 32 of @total costs < 1 part in 2^31. */
+	while (total >> 32) {
+		part >>= 1;
+		total >>= 1;
+	}
+
+	if (!total)
+		return 0;
+	if (part >= total)
+		return VDFS_RATIO_ONE;
+
+	return vdfs_muldiv64(part, VDFS_RATIO_ONE, total);
+}
+
+/* @val scaled by @ratio parts per VDFS_RATIO_ONE. */
+static inline uint64_t vdfs_scale_ratio(uint64_t val, uint32_t ratio)
+{
+	return vdfs_muldiv64(val, ratio, VDFS_RATIO_ONE);
+}
+
+/*
+ * CPU speed in kHz described by a vcpu_time_info's TSC scaling: a TSC tick
+ * lasts (@mul / 2^32) << @shift ns, so the rate is
+ * (10^6 << 32) / (@mul << @shift) kHz. 0 if @mul is.
+ */
+static inline uint64_t vdfs_tsc_khz(uint32_t mul, int shift)
+{
+	const uint64_t num = 1000000ULL << 32;
+
+	if (!mul || shift >= 64 || shift <= -32)
+		return 0;
+	if (shift < 0)
+		return vdfs_muldiv64(num, 1U << -shift, mul);
+
+	return vdfs_muldiv64(num >> shift, 1, mul);
+}
+
+#endif /* __XEN_VDFS_FIXED_H__ */
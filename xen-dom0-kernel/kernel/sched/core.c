@@ -74,7 +74,11 @@
 #include <linux/binfmts.h>
 #include <linux/context_tracking.h>
 #include <asm/xen/hypercall.h>
+#include <asm/tsc.h>
+#include <xen/xen.h>
+#include <xen/interface/xen.h>
 #include <xen/interface/vcpu.h>
+#include <xen/vdfs_fixed.h>
 
 #include <asm/switch_to.h>
 #include <asm/tlb.h>
@@ -2427,6 +2431,130 @@ unsigned long long task_sched_runtime(struct task_struct *p)
 	return ns;
 }
 
+/*
+ * Xen VDFS governor: when booted with xen_vdfs_governor, each vCPU sets its
+ * own VCPUOP_set_target_freq from how busy the scheduler keeps it, so that
+ * a mostly idle guest asks for less of the host without a userspace daemon.
+ *
+ * Utilisation is sampled every tick and scaled by the target in force at
+ * the time, so that it measures work done at full speed rather than time
+ * spent busy at whatever the target was; the target then settles at the
+ * speed that keeps the vCPU busy 1/XEN_VDFS_GOV_HEADROOM of the time.
+ * Under NO_HZ an idle CPU takes no ticks, so the ticks it missed are
+ * counted as idle samples on the next one.
+ *
+ * Raising the target happens on the tick that asks for it, and at once to
+ * 100% when tasks queue up or when one task ran for the whole tick, which
+ * is all the target in force let it do; lowering it waits until the wanted
+ * target has stayed more than XEN_VDFS_GOV_HYST below it for
+ * XEN_VDFS_GOV_DOWN_MS.
+ */
+#define XEN_VDFS_GOV_SHIFT	3	/* EWMA over 2^3 ticks */
+#define XEN_VDFS_GOV_IDLE_MAX	(8 << XEN_VDFS_GOV_SHIFT) /* ticks to decay */
+#define XEN_VDFS_GOV_HEADROOM	80	/* percent */
+#define XEN_VDFS_GOV_STEP	5	/* percent */
+#define XEN_VDFS_GOV_HYST	10	/* percent */
+#define XEN_VDFS_GOV_DOWN_MS	30
+
+struct xen_vdfs_gov {
+	unsigned int util_sum;		/* percent of max, << SHIFT */
+	unsigned int pct;		/* target in force */
+	unsigned long down_since;	/* jiffies the target has been too high */
+	unsigned long last;		/* jiffies of the last sample */
+	struct task_struct *last_curr;	/* running then, never dereferenced */
+	u64 last_exec;			/* its sum_exec_runtime then */
+	u64 last_clock;			/* rq_clock_task() then */
+};
+
+static DEFINE_PER_CPU(struct xen_vdfs_gov, xen_vdfs_gov);
+static bool xen_vdfs_gov_enabled __read_mostly;
+
+static int __init xen_vdfs_gov_setup(char *str)
+{
+	xen_vdfs_gov_enabled = true;
+	return 1;
+}
+__setup("xen_vdfs_governor", xen_vdfs_gov_setup);
+
+static void xen_vdfs_gov_set(int cpu, struct xen_vdfs_gov *gov,
+			     unsigned int pct)
+{
+	uint16_t ratio = pct;
+	int ret;
+
+	ret = HYPERVISOR_vcpu_op(VCPUOP_set_target_freq, cpu, &ratio);
+	if (ret == 0)
+		gov->pct = pct;
+	else if (ret == -ENOSYS)
+		xen_vdfs_gov_enabled = false;
+	gov->down_since = 0;
+}
+
+static void xen_vdfs_gov_tick(int cpu, struct rq *rq)
+{
+	struct xen_vdfs_gov *gov = &per_cpu(xen_vdfs_gov, cpu);
+	struct task_struct *curr = rq->curr;
+	unsigned long missed;
+	unsigned int util, want;
+	u64 clock = rq_clock_task(rq);
+	bool full;
+
+	if (!xen_vdfs_gov_enabled || !xen_domain())
+		return;
+
+	if (unlikely(!gov->pct)) {
+		/* VCPUs start without a target. */
+		gov->pct = 100;
+		gov->util_sum = 100 << XEN_VDFS_GOV_SHIFT;
+		gov->last = jiffies;
+	}
+
+	/* Ticks skipped while idle under NO_HZ, as idle samples. */
+	missed = jiffies - gov->last;
+	missed = missed ? missed - 1 : 0;
+	if (missed >= XEN_VDFS_GOV_IDLE_MAX)
+		gov->util_sum = 0;
+	else
+		while (missed--)
+			gov->util_sum -= gov->util_sum >> XEN_VDFS_GOV_SHIFT;
+	gov->last = jiffies;
+
+	/*
+	 * task_tick() has just brought curr's runtime up to date: if it has
+	 * grown by all of the time since the last tick, curr ran throughout.
+	 */
+	full = !is_idle_task(curr) && curr == gov->last_curr &&
+	       curr->se.sum_exec_runtime - gov->last_exec >=
+	       clock - gov->last_clock;
+	gov->last_curr = curr;
+	gov->last_exec = curr->se.sum_exec_runtime;
+	gov->last_clock = clock;
+
+	gov->util_sum -= gov->util_sum >> XEN_VDFS_GOV_SHIFT;
+	if (!is_idle_task(curr))
+		gov->util_sum += gov->pct;
+	util = gov->util_sum >> XEN_VDFS_GOV_SHIFT;
+
+	if (rq->nr_running > 1 || full)
+		want = 100;
+	else
+		want = roundup(DIV_ROUND_UP(util * 100, XEN_VDFS_GOV_HEADROOM),
+			       XEN_VDFS_GOV_STEP);
+	want = clamp_t(unsigned int, want, XEN_VDFS_GOV_STEP, 100);
+
+	if (want > gov->pct) {
+		xen_vdfs_gov_set(cpu, gov, want);
+	} else if (want + XEN_VDFS_GOV_HYST <= gov->pct) {
+		if (!gov->down_since)
+			gov->down_since = jiffies ? : 1;
+		else if (time_after_eq(jiffies, gov->down_since +
+				       msecs_to_jiffies(XEN_VDFS_GOV_DOWN_MS)))
+			xen_vdfs_gov_set(cpu, gov, want);
+	} else {
+		gov->down_since = 0;
+	}
+}
+
 /*
  * This function gets called by the timer code, with HZ frequency.
  * We call it with interrupts disabled.
@@ -2445,6 +2573,7 @@ void scheduler_tick(void)
 	update_cpu_load_active(rq);
 	raw_spin_unlock(&rq->lock);
 
+	xen_vdfs_gov_tick(cpu, rq);
 	perf_event_task_tick();
 
 #ifdef CONFIG_SMP
@@ -7994,38 +8123,135 @@ void dump_cpu_task(int cpu)
 	sched_show_task(cpu_curr(cpu));
 }
 
-/*Modified by Sawyer
- *
- * This syscal acts as a in-between stage of the guest and the raw set hypercall
- * It accepts a target speed as an input
- */ 
-SYSCALL_DEFINE1(set_freq, int, freq)
-{
-  int ratio = 0, max = 1, cpu = 0;
-  double tempRatio = 0.0;
-
-  max = HYPERVISOR_vcpu_op(VCPUOP_get_dynamic_freq,
-                                cpu, NULL);
-
-  tempRatio = (double)(freq) / (double)(max);
-  ratio = (int)(100.0 * tempRatio);
-
-  if ( ratio > 100){
-    ratio = 100;
-  }else if (ratio < 5){
-    ratio = 5;
-  }
-
-  if(freq < 0){
-    ratio = 100;
-  }else if (freq == 0){
-    ratio = 0;
-  }
-  printk(KERN_EMERG "Ratio is %d", ratio);
-
-  for(cpu = 0; cpu < 4; cpu++){
-  	HYPERVISOR_vcpu_op(VCPUOP_set_target_freq,
-                               cpu, &ratio);
-  }
-  return 0;
+/*
+ * Xen VDFS targets for user space: a frequency in kHz becomes a share of
+ * the vCPU's maximum speed (the TSC frequency, which is what Xen reports),
+ * clamped to [5%, 100%]; 0 or a negative frequency removes the target.
+ */
+static uint16_t xen_vdfs_pct(int freq)
+{
+	if (freq <= 0 || !tsc_khz)
+		return 100;
+
+	return clamp_t(u64, vdfs_muldiv64(freq, 100, tsc_khz), 5, 100);
+}
+
+/*
+ * Set the targets of the vCPUs in @mask, each to its entry in @pct (indexed
+ * by CPU number), with a single multicall rather than a trap per vCPU.
+ * Returns the error of the first vCPU that failed, if any.
+ */
+static int xen_vdfs_set_targets(const struct cpumask *mask, uint16_t *pct)
+{
+	struct multicall_entry *mc;
+	unsigned int cpu, i, nr = 0;
+	int ret = 0;
+
+	mc = kcalloc(cpumask_weight(mask), sizeof(*mc), GFP_KERNEL);
+	if (!mc)
+		return -ENOMEM;
+
+	for_each_cpu(cpu, mask) {
+		mc[nr].op = __HYPERVISOR_vcpu_op;
+		mc[nr].args[0] = VCPUOP_set_target_freq;
+		mc[nr].args[1] = cpu;
+		mc[nr].args[2] = (unsigned long)&pct[cpu];
+		nr++;
+	}
+
+	if (nr)
+		ret = HYPERVISOR_multicall(mc, nr);
+	for (i = 0; !ret && i < nr; i++)
+		ret = mc[i].result;
+
+	kfree(mc);
+	return ret;
+}
+
+/*
+ * Set every online vCPU in the user cpumask (all of them if
+ * @user_mask_ptr is NULL) to run at @freq kHz. Targets act on the whole
+ * guest, so this needs CAP_SYS_NICE as raising a priority does.
+ */
+SYSCALL_DEFINE3(set_freq, int, freq, unsigned int, len,
+		unsigned long __user *, user_mask_ptr)
+{
+	cpumask_var_t mask;
+	uint16_t *pct;
+	unsigned int cpu;
+	int ret;
+
+	if (!capable(CAP_SYS_NICE))
+		return -EPERM;
+	if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+	pct = kcalloc(nr_cpu_ids, sizeof(*pct), GFP_KERNEL);
+	if (!pct) {
+		ret = -ENOMEM;
+		goto out_free_mask;
+	}
+
+	if (user_mask_ptr) {
+		ret = get_user_cpu_mask(user_mask_ptr, len, mask);
+		if (ret)
+			goto out_free;
+	} else {
+		cpumask_setall(mask);
+	}
+
+	get_online_cpus();
+	cpumask_and(mask, mask, cpu_online_mask);
+	for_each_cpu(cpu, mask)
+		pct[cpu] = xen_vdfs_pct(freq);
+	ret = xen_vdfs_set_targets(mask, pct);
+	put_online_cpus();
+
+out_free:
+	kfree(pct);
+out_free_mask:
+	free_cpumask_var(mask);
+	return ret;
+}
+
+/*
+ * Per-vCPU targets: @freqs[i] is the frequency in kHz for vCPU i, for the
+ * online vCPUs among the first @nr. Needs CAP_SYS_NICE, as set_freq does.
+ */
+SYSCALL_DEFINE2(set_freqs, const int __user *, freqs, unsigned int, nr)
+{
+	cpumask_var_t mask;
+	uint16_t *pct;
+	unsigned int cpu;
+	int ret = 0, freq;
+
+	if (!capable(CAP_SYS_NICE))
+		return -EPERM;
+	if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+	pct = kcalloc(nr_cpu_ids, sizeof(*pct), GFP_KERNEL);
+	if (!pct) {
+		ret = -ENOMEM;
+		goto out_free_mask;
+	}
+
+	get_online_cpus();
+	cpumask_clear(mask);
+	for_each_online_cpu(cpu) {
+		if (cpu >= nr)
+			break;
+		if (get_user(freq, &freqs[cpu])) {
+			ret = -EFAULT;
+			goto out_put;
+		}
+		pct[cpu] = xen_vdfs_pct(freq);
+		cpumask_set_cpu(cpu, mask);
+	}
+	ret = xen_vdfs_set_targets(mask, pct);
+
+out_put:
+	put_online_cpus();
+	kfree(pct);
+out_free_mask:
+	free_cpumask_var(mask);
+	return ret;
 }